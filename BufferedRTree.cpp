@@ -0,0 +1,114 @@
+#include "BufferedRTree.h"
+
+BufferedRTree::BufferedRTree()
+{
+    m_maxBuffered = 256;
+    m_maxAgeMs = -1;
+}
+
+
+BufferedRTree::~BufferedRTree()
+{
+}
+
+
+// a_maxAgeMs < 0 disables the age trigger.
+void BufferedRTree::SetFlushPolicy(int a_maxBuffered, int a_maxAgeMs)
+{
+    m_maxBuffered = Max(a_maxBuffered, 1);
+    m_maxAgeMs = a_maxAgeMs;
+}
+
+
+void BufferedRTree::Insert(const int a_min[2], const int a_max[2], vector<pair<int, int>>& a_dataId)
+{
+    if (m_buffer.empty())
+    {
+        m_oldest = chrono::steady_clock::now();
+    }
+
+    Branch branch;
+    branch.m_rect = Rect(a_min[0], a_min[1], a_max[0], a_max[1]);
+    branch.m_child = NULL;
+    branch.m_data = a_dataId;
+    m_buffer.push_back(branch);
+
+    if ((int)m_buffer.size() >= m_maxBuffered || Expired())
+    {
+        Flush();
+    }
+}
+
+
+// Returns true if a_dataId was still buffered, and so never reaches the
+// tree, or if the tree removed it.
+bool BufferedRTree::Remove(const int a_min[2], const int a_max[2], const vector<pair<int, int>>& a_dataId)
+{
+    for (unsigned int i = 0; i < m_buffer.size(); ++i)
+    {
+        if (m_buffer[i].m_data == a_dataId)
+        {
+            m_buffer[i] = m_buffer.back();
+            m_buffer.pop_back();
+            return true;
+        }
+    }
+
+    return m_tree.Remove(a_min, a_max, a_dataId);
+}
+
+
+void BufferedRTree::RemoveAll()
+{
+    m_buffer.clear();
+    m_tree.RemoveAll();
+}
+
+
+void BufferedRTree::Flush()
+{
+    m_tree.InsertBatch(m_buffer);
+    m_buffer.clear();
+}
+
+
+// Checked by Search as well as Insert, so a buffer that stops receiving
+// inserts still reaches the tree once it is old enough.
+bool BufferedRTree::Expired() const
+{
+    return m_maxAgeMs >= 0 && !m_buffer.empty() &&
+        chrono::steady_clock::now() - m_oldest >= chrono::milliseconds(m_maxAgeMs);
+}
+
+
+bool BufferedRTree::Search(const Rect& a_rect, vector<vector<pair<int, int>>>& a_results)
+{
+    if (Expired())
+    {
+        Flush();
+    }
+
+    m_tree.Search(a_rect, a_results);
+
+    for (unsigned int i = 0; i < m_buffer.size(); ++i)
+    {
+        if (RTree::Overlap(&m_buffer[i].m_rect, &a_rect))
+        {
+            a_results.push_back(m_buffer[i].m_data);
+        }
+    }
+    return !a_results.empty();
+}
+
+
+int BufferedRTree::Count()
+{
+    return m_tree.Count() + (int)m_buffer.size();
+}
+
+
+int BufferedRTree::Buffered() const
+{
+    return (int)m_buffer.size();
+}
+
@@ -0,0 +1,45 @@
+#ifndef BUFFEREDRTREE_H
+#define BUFFEREDRTREE_H
+
+#include <chrono>
+
+#include "RTree.h"
+
+
+// Inserts land in a small unsorted run that every Search scans linearly.
+// When the run reaches m_maxBuffered objects, or its oldest object is older
+// than m_maxAgeMs, it goes to RTree::InsertBatch, which inserts it in
+// Hilbert order with the path cache on, so consecutive inserts reuse most of
+// the previous root-to-leaf path.
+class BufferedRTree
+{
+public:
+
+    BufferedRTree();
+    virtual ~BufferedRTree();
+
+    void SetFlushPolicy(int a_maxBuffered, int a_maxAgeMs);
+
+    void Insert(const int a_min[2], const int a_max[2], vector<pair<int, int>>& a_dataId);
+    bool Remove(const int a_min[2], const int a_max[2], const vector<pair<int, int>>& a_dataId);
+    void RemoveAll();
+    void Flush();
+
+    bool Search(const Rect& a_rect, vector<vector<pair<int, int>>>& a_results);
+
+    int Count();
+    int Buffered() const;
+
+
+protected:
+
+    bool Expired() const;
+
+    RTree m_tree;
+    vector<Branch> m_buffer;
+    chrono::steady_clock::time_point m_oldest;
+    int m_maxBuffered;
+    int m_maxAgeMs;
+};
+
+#endif
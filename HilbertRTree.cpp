@@ -0,0 +1,431 @@
+#include "HilbertRTree.h"
+
+HilbertRTree::HilbertRTree()
+{
+    m_root = AllocNode(0);
+}
+
+
+HilbertRTree::HilbertRTree(const HilbertRTree& other) : HilbertRTree()
+{
+    CopyRec(m_root, other.m_root);
+}
+
+
+HilbertRTree::~HilbertRTree()
+{
+    RemoveAllRec(m_root);
+}
+
+
+HilbertRTree& HilbertRTree::operator=(const HilbertRTree& other)
+{
+    if (this != &other)
+    {
+        RemoveAllRec(m_root);
+        m_root = AllocNode(0);
+        CopyRec(m_root, other.m_root);
+    }
+    return *this;
+}
+
+
+void HilbertRTree::Insert(const int a_min[2], const int a_max[2], vector<pair<int, int>>& a_dataId)
+{
+    HilbertBranch branch;
+    branch.m_rect = Rect(a_min[0], a_min[1], a_max[0], a_max[1]);
+    branch.m_child = NULL;
+    branch.m_lhv = RTree::HilbertValue((int)(((long long)a_min[0] + a_max[0]) / 2),
+        (int)(((long long)a_min[1] + a_max[1]) / 2));
+    branch.m_data = a_dataId;
+
+    if (InsertRec(m_root, branch))
+    {
+        HilbertNode* newRoot = AllocNode(m_root->m_level + 1);
+        HilbertNode* nodes[2] = { m_root, AllocNode(m_root->m_level) };
+
+        vector<HilbertBranch> entries;
+        Gather(m_root, entries);
+        Distribute(entries, nodes, 2);
+
+        for (int i = 0; i < 2; ++i)
+        {
+            HilbertBranch up;
+            up.m_child = nodes[i];
+            Refresh(&up);
+            newRoot->m_branch[newRoot->m_count++] = up;
+        }
+        m_root = newRoot;
+    }
+}
+
+
+bool HilbertRTree::Remove(const int a_min[2], const int a_max[2], const vector<pair<int, int>>& a_dataId)
+{
+    Rect rect(a_min[0], a_min[1], a_max[0], a_max[1]);
+    bool found = false;
+
+    RemoveRec(m_root, &rect, a_dataId, &found);
+
+    if (m_root->IsInternalNode() && m_root->m_count == 0)
+    {
+        m_root->m_level = 0;
+    }
+
+    while (m_root->IsInternalNode() && m_root->m_count == 1)
+    {
+        HilbertNode* child = m_root->m_branch[0].m_child;
+        FreeNode(m_root);
+        m_root = child;
+    }
+    return found;
+}
+
+
+void HilbertRTree::RemoveAll()
+{
+    RemoveAllRec(m_root);
+    m_root = AllocNode(0);
+}
+
+
+bool HilbertRTree::Search(const Rect& a_rect, vector<vector<pair<int, int>>>& a_results)
+{
+    a_results.clear();
+    SearchRec(m_root, a_rect, a_results);
+    return !a_results.empty();
+}
+
+
+int HilbertRTree::Count()
+{
+    int nodes = 0, used = 0, entries = 0;
+    CountRec(m_root, nodes, used, entries);
+    return entries;
+}
+
+
+// Share of m_branch slots in use over all nodes (overflow slot excluded).
+float HilbertRTree::Utilization()
+{
+    int nodes = 0, used = 0, entries = 0;
+    CountRec(m_root, nodes, used, entries);
+    return (float)used / ((float)nodes * MAXNODES);
+}
+
+
+HilbertNode* HilbertRTree::AllocNode(int a_level)
+{
+    HilbertNode* node = new HilbertNode;
+    node->m_count = 0;
+    node->m_level = a_level;
+    return node;
+}
+
+
+void HilbertRTree::FreeNode(HilbertNode* a_node)
+{
+    delete a_node;
+}
+
+
+void HilbertRTree::RemoveAllRec(HilbertNode* a_node)
+{
+    if (a_node->IsInternalNode())
+    {
+        for (int index = 0; index < a_node->m_count; ++index)
+        {
+            RemoveAllRec(a_node->m_branch[index].m_child);
+        }
+    }
+    FreeNode(a_node);
+}
+
+
+void HilbertRTree::CopyRec(HilbertNode* current, HilbertNode* other)
+{
+    current->m_level = other->m_level;
+    current->m_count = other->m_count;
+
+    for (int index = 0; index < current->m_count; ++index)
+    {
+        current->m_branch[index] = other->m_branch[index];
+
+        if (current->IsInternalNode())
+        {
+            current->m_branch[index].m_child = AllocNode(other->m_level - 1);
+            CopyRec(current->m_branch[index].m_child, other->m_branch[index].m_child);
+        }
+    }
+}
+
+
+// Returns true when a_node is left holding MAXNODES + 1 entries; the caller
+// (the parent, or Insert for the root) resolves that.
+bool HilbertRTree::InsertRec(HilbertNode* a_node, const HilbertBranch& a_branch)
+{
+    int index = 0;
+    while (index < a_node->m_count && a_node->m_branch[index].m_lhv < a_branch.m_lhv)
+    {
+        ++index;
+    }
+
+    if (a_node->IsLeaf())
+    {
+        InsertBranchAt(a_node, index, a_branch);
+        return a_node->m_count > MAXNODES;
+    }
+
+    if (index == a_node->m_count)
+    {
+        --index;
+    }
+
+    if (InsertRec(a_node->m_branch[index].m_child, a_branch))
+    {
+        HandleOverflow(a_node, index);
+    }
+    else
+    {
+        Refresh(&a_node->m_branch[index]);
+    }
+    return a_node->m_count > MAXNODES;
+}
+
+
+void HilbertRTree::HandleOverflow(HilbertNode* a_parent, int a_index)
+{
+    int left = a_index, right = a_index + 1;
+    if (right >= a_parent->m_count)
+    {
+        left = a_index - 1;
+        right = a_index;
+    }
+
+    vector<HilbertBranch> entries;
+
+    if (left < 0)
+    {
+        HilbertNode* nodes[2] = { a_parent->m_branch[a_index].m_child, AllocNode(a_parent->m_branch[a_index].m_child->m_level) };
+        Gather(nodes[0], entries);
+        Distribute(entries, nodes, 2);
+
+        HilbertBranch branch;
+        branch.m_child = nodes[1];
+        Refresh(&branch);
+        Refresh(&a_parent->m_branch[a_index]);
+        InsertBranchAt(a_parent, a_index + 1, branch);
+        return;
+    }
+
+    HilbertNode* leftNode = a_parent->m_branch[left].m_child;
+    HilbertNode* rightNode = a_parent->m_branch[right].m_child;
+    Gather(leftNode, entries);
+    Gather(rightNode, entries);
+
+    if ((int)entries.size() <= 2 * MAXNODES)
+    {
+        HilbertNode* nodes[2] = { leftNode, rightNode };
+        Distribute(entries, nodes, 2);
+        Refresh(&a_parent->m_branch[left]);
+        Refresh(&a_parent->m_branch[right]);
+        return;
+    }
+
+    HilbertNode* nodes[3] = { leftNode, rightNode, AllocNode(leftNode->m_level) };
+    Distribute(entries, nodes, 3);
+
+    HilbertBranch branch;
+    branch.m_child = nodes[2];
+    Refresh(&branch);
+    Refresh(&a_parent->m_branch[left]);
+    Refresh(&a_parent->m_branch[right]);
+    InsertBranchAt(a_parent, right + 1, branch);
+}
+
+
+bool HilbertRTree::RemoveRec(HilbertNode* a_node, const Rect* a_rect, const vector<pair<int, int>>& a_id, bool* a_found)
+{
+    for (int index = 0; index < a_node->m_count && !*a_found; ++index)
+    {
+        HilbertBranch* branch = &a_node->m_branch[index];
+
+        if (!RTree::Overlap(a_rect, &branch->m_rect))
+        {
+            continue;
+        }
+
+        if (a_node->IsLeaf())
+        {
+            if (branch->m_data == a_id)
+            {
+                RemoveBranchAt(a_node, index);
+                *a_found = true;
+            }
+        }
+        else if (RemoveRec(branch->m_child, a_rect, a_id, a_found))
+        {
+            HandleUnderflow(a_node, index);
+        }
+        else if (*a_found)
+        {
+            Refresh(branch);
+        }
+    }
+    return *a_found && a_node->m_count < HILBERT_MINNODES;
+}
+
+
+void HilbertRTree::HandleUnderflow(HilbertNode* a_parent, int a_index)
+{
+    if (a_parent->m_count < 2)
+    {
+        if (a_parent->m_branch[a_index].m_child->m_count == 0)
+        {
+            FreeNode(a_parent->m_branch[a_index].m_child);
+            RemoveBranchAt(a_parent, a_index);
+        }
+        else
+        {
+            Refresh(&a_parent->m_branch[a_index]);
+        }
+        return;
+    }
+
+    int left = a_index, right = a_index + 1;
+    if (right >= a_parent->m_count)
+    {
+        left = a_index - 1;
+        right = a_index;
+    }
+
+    HilbertNode* leftNode = a_parent->m_branch[left].m_child;
+    HilbertNode* rightNode = a_parent->m_branch[right].m_child;
+
+    vector<HilbertBranch> entries;
+    Gather(leftNode, entries);
+    Gather(rightNode, entries);
+
+    if ((int)entries.size() <= MAXNODES)
+    {
+        Distribute(entries, &leftNode, 1);
+        FreeNode(rightNode);
+        RemoveBranchAt(a_parent, right);
+        Refresh(&a_parent->m_branch[left]);
+        return;
+    }
+
+    HilbertNode* nodes[2] = { leftNode, rightNode };
+    Distribute(entries, nodes, 2);
+    Refresh(&a_parent->m_branch[left]);
+    Refresh(&a_parent->m_branch[right]);
+}
+
+
+// Spreads the (LHV-ordered) entries evenly over the nodes, in order.
+void HilbertRTree::Distribute(vector<HilbertBranch>& a_entries, HilbertNode** a_nodes, int a_nodeCount)
+{
+    int total = (int)a_entries.size();
+    int next = 0;
+
+    for (int i = 0; i < a_nodeCount; ++i)
+    {
+        int share = total / a_nodeCount + (i < total % a_nodeCount ? 1 : 0);
+
+        a_nodes[i]->m_count = 0;
+        for (int k = 0; k < share; ++k)
+        {
+            a_nodes[i]->m_branch[a_nodes[i]->m_count++] = a_entries[next++];
+        }
+    }
+}
+
+
+void HilbertRTree::Gather(HilbertNode* a_node, vector<HilbertBranch>& a_entries)
+{
+    for (int index = 0; index < a_node->m_count; ++index)
+    {
+        a_entries.push_back(a_node->m_branch[index]);
+    }
+}
+
+
+void HilbertRTree::InsertBranchAt(HilbertNode* a_node, int a_index, const HilbertBranch& a_branch)
+{
+    for (int index = a_node->m_count; index > a_index; --index)
+    {
+        a_node->m_branch[index] = a_node->m_branch[index - 1];
+    }
+    a_node->m_branch[a_index] = a_branch;
+    ++a_node->m_count;
+}
+
+
+void HilbertRTree::RemoveBranchAt(HilbertNode* a_node, int a_index)
+{
+    for (int index = a_index; index < a_node->m_count - 1; ++index)
+    {
+        a_node->m_branch[index] = a_node->m_branch[index + 1];
+    }
+    --a_node->m_count;
+}
+
+
+void HilbertRTree::Refresh(HilbertBranch* a_branch)
+{
+    HilbertNode* child = a_branch->m_child;
+
+    a_branch->m_rect = NodeCover(child);
+    a_branch->m_lhv = child->m_branch[child->m_count - 1].m_lhv;
+}
+
+
+Rect HilbertRTree::NodeCover(HilbertNode* a_node)
+{
+    Rect rect = a_node->m_branch[0].m_rect;
+    for (int index = 1; index < a_node->m_count; ++index)
+    {
+        rect = RTree::CombineRect(&rect, &a_node->m_branch[index].m_rect);
+    }
+    return rect;
+}
+
+
+void HilbertRTree::SearchRec(HilbertNode* a_node, const Rect& a_rect, vector<vector<pair<int, int>>>& a_results)
+{
+    for (int index = 0; index < a_node->m_count; ++index)
+    {
+        if (!RTree::Overlap(&a_node->m_branch[index].m_rect, &a_rect))
+        {
+            continue;
+        }
+
+        if (a_node->IsInternalNode())
+        {
+            SearchRec(a_node->m_branch[index].m_child, a_rect, a_results);
+        }
+        else
+        {
+            a_results.push_back(a_node->m_branch[index].m_data);
+        }
+    }
+}
+
+
+void HilbertRTree::CountRec(HilbertNode* a_node, int& a_nodes, int& a_used, int& a_entries)
+{
+    ++a_nodes;
+    a_used += a_node->m_count;
+
+    if (a_node->IsInternalNode())
+    {
+        for (int index = 0; index < a_node->m_count; ++index)
+        {
+            CountRec(a_node->m_branch[index].m_child, a_nodes, a_used, a_entries);
+        }
+    }
+    else
+    {
+        a_entries += a_node->m_count;
+    }
+}
@@ -0,0 +1,80 @@
+#ifndef HILBERTRTREE_H
+#define HILBERTRTREE_H
+
+#include "RTree.h"
+
+#define HILBERT_MINNODES Max(1, MAXNODES / 2)
+
+
+struct HilbertNode;
+
+struct HilbertBranch
+{
+    Rect m_rect;
+    HilbertNode* m_child;
+    unsigned long long m_lhv;
+    vector<pair<int, int>> m_data;
+};
+
+struct HilbertNode
+{
+    bool IsInternalNode() { return (m_level > 0); }
+    bool IsLeaf() { return (m_level == 0); }
+
+    int m_count;
+    int m_level;
+    HilbertBranch m_branch[MAXNODES + 1];
+};
+
+
+// Hilbert R-tree (Kamel & Faloutsos). Every node keeps its entries sorted by
+// m_lhv: the Hilbert value of the MBR center at a leaf, the largest value
+// below it at an internal node. An overflowing node first shares entries with
+// its neighbour in that order and only splits 2-to-3 when both are full;
+// an underfull node borrows from or merges into its neighbour.
+class HilbertRTree
+{
+public:
+
+    HilbertRTree();
+    HilbertRTree(const HilbertRTree& other);
+    virtual ~HilbertRTree();
+
+    HilbertRTree& operator=(const HilbertRTree& other);
+
+    void Insert(const int a_min[2], const int a_max[2], vector<pair<int, int>>& a_dataId);
+    bool Remove(const int a_min[2], const int a_max[2], const vector<pair<int, int>>& a_dataId);
+    void RemoveAll();
+
+    bool Search(const Rect& a_rect, vector<vector<pair<int, int>>>& a_results);
+
+    int Count();
+    float Utilization();
+
+
+protected:
+
+    HilbertNode* AllocNode(int a_level);
+    void FreeNode(HilbertNode* a_node);
+    void RemoveAllRec(HilbertNode* a_node);
+    void CopyRec(HilbertNode* current, HilbertNode* other);
+
+    bool InsertRec(HilbertNode* a_node, const HilbertBranch& a_branch);
+    bool RemoveRec(HilbertNode* a_node, const Rect* a_rect, const vector<pair<int, int>>& a_id, bool* a_found);
+    void HandleOverflow(HilbertNode* a_parent, int a_index);
+    void HandleUnderflow(HilbertNode* a_parent, int a_index);
+    void Distribute(vector<HilbertBranch>& a_entries, HilbertNode** a_nodes, int a_nodeCount);
+    void Gather(HilbertNode* a_node, vector<HilbertBranch>& a_entries);
+    void InsertBranchAt(HilbertNode* a_node, int a_index, const HilbertBranch& a_branch);
+    void RemoveBranchAt(HilbertNode* a_node, int a_index);
+    void Refresh(HilbertBranch* a_branch);
+
+    Rect NodeCover(HilbertNode* a_node);
+
+    void SearchRec(HilbertNode* a_node, const Rect& a_rect, vector<vector<pair<int, int>>>& a_results);
+    void CountRec(HilbertNode* a_node, int& a_nodes, int& a_used, int& a_entries);
+
+    HilbertNode* m_root;
+};
+
+#endif
@@ -0,0 +1,898 @@
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "PagedRTree.h"
+
+#define PAGED_MAGIC 0x52545047u
+
+// Page 0: magic, root, page count, free-page head (uint32 each), then the
+// logical end of the data file and the head of each data free list.
+struct PageMeta
+{
+    uint32_t m_magic;
+    uint32_t m_root;
+    uint32_t m_pageCount;
+    uint32_t m_freeHead;
+    uint64_t m_dataEnd;
+    uint64_t m_dataFree[DATA_CLASSES];
+};
+
+static_assert(sizeof(PageMeta) <= RTREE_PAGE_SIZE, "meta page overflow");
+
+
+BufferPool::BufferPool(const string& a_path, int a_frames)
+{
+    m_fd = open(a_path.c_str(), O_RDWR | O_CREAT, 0644);
+    m_failed = (m_fd < 0);
+    m_scratch.resize(RTREE_PAGE_SIZE);
+
+    m_frames.resize(Max(a_frames, 8));
+    for (unsigned int i = 0; i < m_frames.size(); ++i)
+    {
+        m_frames[i].m_page = 0;
+        m_frames[i].m_pinCount = 0;
+        m_frames[i].m_dirty = false;
+        m_frames[i].m_referenced = false;
+        m_frames[i].m_valid = false;
+        m_frames[i].m_data.resize(RTREE_PAGE_SIZE);
+    }
+    m_clockHand = 0;
+
+    ResetStats();
+}
+
+
+BufferPool::~BufferPool()
+{
+    Flush();
+    if (m_fd >= 0)
+    {
+        close(m_fd);
+    }
+}
+
+
+// After an I/O error or with every frame pinned, Pin hands out a zeroed
+// scratch page (an empty leaf to the tree code) and the pool stays failed:
+// nothing more is read or written back, so callers can unwind and report
+// the failure instead of working on a garbage page.
+char* BufferPool::Pin(uint32_t a_page)
+{
+    if (m_failed)
+    {
+        return Scratch();
+    }
+
+    auto it = m_pageTable.find(a_page);
+    if (it != m_pageTable.end())
+    {
+        Frame* frame = &m_frames[it->second];
+        ++frame->m_pinCount;
+        frame->m_referenced = true;
+        ++m_hits;
+        return frame->m_data.data();
+    }
+
+    int index = Victim();
+    if (index < 0)
+    {
+        m_failed = true;
+        return Scratch();
+    }
+
+    Frame* frame = &m_frames[index];
+    if (frame->m_valid)
+    {
+        if (!WriteBack(frame))
+        {
+            return Scratch();
+        }
+        m_pageTable.erase(frame->m_page);
+        frame->m_valid = false;
+    }
+
+    // A page past the end of the file is new and reads as zeroes; a short
+    // read inside the file is a torn page.
+    ssize_t n = pread(m_fd, frame->m_data.data(), RTREE_PAGE_SIZE, (off_t)a_page * RTREE_PAGE_SIZE);
+    if (n < 0 || (n > 0 && n < RTREE_PAGE_SIZE))
+    {
+        m_failed = true;
+        return Scratch();
+    }
+    if (n == 0)
+    {
+        memset(frame->m_data.data(), 0, RTREE_PAGE_SIZE);
+    }
+    ++m_faults;
+
+    frame->m_page = a_page;
+    frame->m_pinCount = 1;
+    frame->m_dirty = false;
+    frame->m_referenced = true;
+    frame->m_valid = true;
+    m_pageTable[a_page] = index;
+
+    return frame->m_data.data();
+}
+
+
+void BufferPool::Unpin(uint32_t a_page, bool a_dirty)
+{
+    auto it = m_pageTable.find(a_page);
+    if (it == m_pageTable.end())
+    {
+        // Handed out as scratch by a failed Pin.
+        ASSERT(m_failed);
+        return;
+    }
+
+    Frame* frame = &m_frames[it->second];
+    ASSERT(frame->m_pinCount > 0);
+    --frame->m_pinCount;
+    frame->m_dirty = frame->m_dirty || a_dirty;
+}
+
+
+bool BufferPool::Flush()
+{
+    for (unsigned int i = 0; i < m_frames.size(); ++i)
+    {
+        if (m_frames[i].m_valid)
+        {
+            WriteBack(&m_frames[i]);
+        }
+    }
+    return !m_failed;
+}
+
+
+bool BufferPool::Failed() const
+{
+    return m_failed;
+}
+
+
+char* BufferPool::Scratch()
+{
+    memset(m_scratch.data(), 0, m_scratch.size());
+    return m_scratch.data();
+}
+
+
+int BufferPool::Victim()
+{
+    for (unsigned int step = 0; step < 2 * m_frames.size() + 1; ++step)
+    {
+        int index = m_clockHand;
+        Frame* frame = &m_frames[index];
+        m_clockHand = (m_clockHand + 1) % m_frames.size();
+
+        if (!frame->m_valid)
+        {
+            return index;
+        }
+        if (frame->m_pinCount > 0)
+        {
+            continue;
+        }
+        if (frame->m_referenced)
+        {
+            frame->m_referenced = false;
+            continue;
+        }
+        return index;
+    }
+
+    // Every frame is pinned.
+    return -1;
+}
+
+
+bool BufferPool::WriteBack(Frame* a_frame)
+{
+    if (a_frame->m_dirty && !m_failed)
+    {
+        ssize_t n = pwrite(m_fd, a_frame->m_data.data(), RTREE_PAGE_SIZE, (off_t)a_frame->m_page * RTREE_PAGE_SIZE);
+        if (n != RTREE_PAGE_SIZE)
+        {
+            m_failed = true;
+            return false;
+        }
+        a_frame->m_dirty = false;
+        ++m_writes;
+    }
+    return !m_failed;
+}
+
+
+void BufferPool::ResetStats()
+{
+    m_faults = 0;
+    m_writes = 0;
+    m_hits = 0;
+}
+
+
+long long BufferPool::Faults() const
+{
+    return m_faults;
+}
+
+
+long long BufferPool::Writes() const
+{
+    return m_writes;
+}
+
+
+long long BufferPool::Hits() const
+{
+    return m_hits;
+}
+
+
+PagedRTree::PagedRTree(const string& a_path, int a_poolFrames)
+{
+    m_pool = new BufferPool(a_path, a_poolFrames);
+    m_root = 0;
+    m_pageCount = 1;
+    m_freeHead = 0;
+    m_dataEnd = 0;
+    for (int c = 0; c < DATA_CLASSES; ++c)
+    {
+        m_dataFree[c] = 0;
+    }
+
+    m_dataFd = open((a_path + ".dat").c_str(), O_RDWR | O_CREAT, 0644);
+    m_failed = (m_dataFd < 0);
+    if (Failed())
+    {
+        return;
+    }
+
+    PageMeta* meta = (PageMeta*)m_pool->Pin(0);
+    bool existing = (meta->m_magic == PAGED_MAGIC);
+    if (existing)
+    {
+        m_root = meta->m_root;
+        m_pageCount = meta->m_pageCount;
+        m_freeHead = meta->m_freeHead;
+        m_dataEnd = Max(meta->m_dataEnd, (uint64_t)lseek(m_dataFd, 0, SEEK_END));
+        for (int c = 0; c < DATA_CLASSES; ++c)
+        {
+            m_dataFree[c] = meta->m_dataFree[c];
+        }
+    }
+    m_pool->Unpin(0, false);
+
+    if (!existing && !Failed())
+    {
+        m_root = AllocPage(0);
+        WriteMeta();
+    }
+}
+
+
+PagedRTree::~PagedRTree()
+{
+    if (!Failed())
+    {
+        WriteMeta();
+    }
+    delete m_pool;
+    if (m_dataFd >= 0)
+    {
+        close(m_dataFd);
+    }
+}
+
+
+// True once opening either file or any read or write has failed; from then
+// on the tree does no more I/O and every update returns false.
+bool PagedRTree::Failed() const
+{
+    return m_failed || m_pool->Failed();
+}
+
+
+BufferPool& PagedRTree::Pool()
+{
+    return *m_pool;
+}
+
+
+void PagedRTree::WriteMeta()
+{
+    PageMeta* meta = (PageMeta*)m_pool->Pin(0);
+    meta->m_magic = PAGED_MAGIC;
+    meta->m_root = m_root;
+    meta->m_pageCount = m_pageCount;
+    meta->m_freeHead = m_freeHead;
+    meta->m_dataEnd = m_dataEnd;
+    for (int c = 0; c < DATA_CLASSES; ++c)
+    {
+        meta->m_dataFree[c] = m_dataFree[c];
+    }
+    m_pool->Unpin(0, true);
+}
+
+
+PageNode* PagedRTree::PinNode(uint32_t a_page)
+{
+    return (PageNode*)m_pool->Pin(a_page);
+}
+
+
+void PagedRTree::UnpinNode(uint32_t a_page, bool a_dirty)
+{
+    m_pool->Unpin(a_page, a_dirty);
+}
+
+
+// Free pages are chained through their first four bytes.
+uint32_t PagedRTree::AllocPage(int a_level)
+{
+    uint32_t page;
+
+    if (m_freeHead != 0)
+    {
+        page = m_freeHead;
+        uint32_t* freed = (uint32_t*)m_pool->Pin(page);
+        m_freeHead = freed[0];
+        m_pool->Unpin(page, false);
+    }
+    else
+    {
+        page = m_pageCount++;
+    }
+
+    PageNode* node = PinNode(page);
+    node->m_count = 0;
+    node->m_level = a_level;
+    UnpinNode(page, true);
+
+    return page;
+}
+
+
+void PagedRTree::FreePage(uint32_t a_page)
+{
+    uint32_t* freed = (uint32_t*)m_pool->Pin(a_page);
+    freed[0] = m_freeHead;
+    m_pool->Unpin(a_page, true);
+    m_freeHead = a_page;
+}
+
+
+// Objects live in slots of 2^c vertices (c the object's size class), so a
+// slot freed by Remove fits any later object of the same class. Free slots
+// of a class are chained through the eight bytes after their count.
+int PagedRTree::DataClass(size_t a_vertices) const
+{
+    int c = 0;
+    while (c + 1 < DATA_CLASSES && ((size_t)1 << c) < a_vertices)
+    {
+        ++c;
+    }
+    return c;
+}
+
+
+uint64_t PagedRTree::WriteObject(const vector<pair<int, int>>& a_data)
+{
+    vector<int32_t> buf;
+    buf.push_back((int32_t)a_data.size());
+    for (unsigned int i = 0; i < a_data.size(); ++i)
+    {
+        buf.push_back(a_data[i].first);
+        buf.push_back(a_data[i].second);
+    }
+
+    int c = DataClass(a_data.size());
+    uint64_t offset = m_dataFree[c];
+    if (offset != 0)
+    {
+        uint64_t next = 0;
+        if (pread(m_dataFd, &next, sizeof(next), (off_t)(offset + sizeof(int32_t))) != (ssize_t)sizeof(next))
+        {
+            m_failed = true;
+            return 0;
+        }
+        m_dataFree[c] = next;
+    }
+    else
+    {
+        // Offset 0 marks the end of a free list, so the file starts with
+        // an empty slot.
+        offset = Max(m_dataEnd, (uint64_t)sizeof(int32_t) + sizeof(uint64_t));
+        m_dataEnd = offset + sizeof(int32_t) + ((uint64_t)1 << c) * sizeof(pair<int, int>);
+    }
+
+    ssize_t bytes = (ssize_t)(buf.size() * sizeof(int32_t));
+    if (pwrite(m_dataFd, buf.data(), bytes, (off_t)offset) != bytes)
+    {
+        m_failed = true;
+    }
+    return offset;
+}
+
+
+void PagedRTree::FreeObject(uint64_t a_offset, size_t a_vertices)
+{
+    int c = DataClass(a_vertices);
+    if (pwrite(m_dataFd, &m_dataFree[c], sizeof(uint64_t), (off_t)(a_offset + sizeof(int32_t))) != (ssize_t)sizeof(uint64_t))
+    {
+        m_failed = true;
+        return;
+    }
+    m_dataFree[c] = a_offset;
+}
+
+
+bool PagedRTree::ReadObject(uint64_t a_offset, vector<pair<int, int>>& a_data)
+{
+    a_data.clear();
+
+    int32_t n = 0;
+    if (m_failed || pread(m_dataFd, &n, sizeof(n), (off_t)a_offset) != (ssize_t)sizeof(n) || n < 0 ||
+        ((size_t)1 << DataClass(n)) < (size_t)n)
+    {
+        m_failed = true;
+        return false;
+    }
+
+    vector<int32_t> buf(2 * n);
+    ssize_t bytes = (ssize_t)(buf.size() * sizeof(int32_t));
+    if (pread(m_dataFd, buf.data(), bytes, (off_t)(a_offset + sizeof(n))) != bytes)
+    {
+        m_failed = true;
+        return false;
+    }
+
+    a_data.resize(n);
+    for (int i = 0; i < n; ++i)
+    {
+        a_data[i] = make_pair(buf[2 * i], buf[2 * i + 1]);
+    }
+    return true;
+}
+
+
+bool PagedRTree::Insert(const int a_min[2], const int a_max[2], vector<pair<int, int>>& a_dataId)
+{
+    if (Failed())
+    {
+        return false;
+    }
+
+    PageEntry entry;
+    entry.m_rect = Rect(a_min[0], a_min[1], a_max[0], a_max[1]);
+    entry.m_ref = WriteObject(a_dataId);
+    if (Failed())
+    {
+        return false;
+    }
+
+    InsertRect(entry, 0);
+    return !Failed();
+}
+
+
+void PagedRTree::InsertRect(const PageEntry& a_entry, int a_level)
+{
+    uint32_t newPage;
+
+    if (InsertRec(a_entry, m_root, &newPage, a_level))
+    {
+        PageNode* root = PinNode(m_root);
+        int level = root->m_level;
+        UnpinNode(m_root, false);
+
+        uint32_t newRoot = AllocPage(level + 1);
+
+        PageEntry left, right;
+        left.m_rect = NodeCover(m_root);
+        left.m_ref = m_root;
+        right.m_rect = NodeCover(newPage);
+        right.m_ref = newPage;
+
+        PageNode* node = PinNode(newRoot);
+        node->m_entry[0] = left;
+        node->m_entry[1] = right;
+        node->m_count = 2;
+        UnpinNode(newRoot, true);
+
+        m_root = newRoot;
+    }
+}
+
+
+bool PagedRTree::InsertRec(const PageEntry& a_entry, uint32_t a_page, uint32_t* a_newPage, int a_level)
+{
+    PageNode* node = PinNode(a_page);
+    bool split = false;
+
+    if (node->m_level > a_level)
+    {
+        int index = ChooseLeaf(&a_entry.m_rect, node);
+        uint32_t child = (uint32_t)node->m_entry[index].m_ref;
+        uint32_t otherPage;
+
+        if (!InsertRec(a_entry, child, &otherPage, a_level))
+        {
+            node->m_entry[index].m_rect = RTree::CombineRect(&a_entry.m_rect, &node->m_entry[index].m_rect);
+        }
+        else
+        {
+            node->m_entry[index].m_rect = NodeCover(child);
+
+            PageEntry entry;
+            entry.m_rect = NodeCover(otherPage);
+            entry.m_ref = otherPage;
+            split = AddEntry(entry, node, a_newPage);
+        }
+        UnpinNode(a_page, true);
+        return split;
+    }
+    else if (node->m_level == a_level)
+    {
+        split = AddEntry(a_entry, node, a_newPage);
+        UnpinNode(a_page, true);
+        return split;
+    }
+
+    UnpinNode(a_page, false);
+    return false;
+}
+
+
+bool PagedRTree::AddEntry(const PageEntry& a_entry, PageNode* a_node, uint32_t* a_newPage)
+{
+    if (a_node->m_count < PAGE_MAXNODES)
+    {
+        a_node->m_entry[a_node->m_count++] = a_entry;
+        return false;
+    }
+
+    SplitNode(a_node, a_entry, a_newPage);
+    return true;
+}
+
+
+// Same quadratic split as RTree::QuadraticSplit, over a page's worth of
+// entries.
+void PagedRTree::SplitNode(PageNode* a_node, const PageEntry& a_entry, uint32_t* a_newPage)
+{
+    int total = PAGE_MAXNODES + 1;
+    vector<PageEntry> buf(a_node->m_entry, a_node->m_entry + PAGE_MAXNODES);
+    buf.push_back(a_entry);
+
+    vector<int> partition(total, -1);
+    vector<float> area(total);
+    int count[2] = { 0, 0 };
+    Rect cover[2];
+    float coverArea[2];
+
+    for (int index = 0; index < total; ++index)
+    {
+        area[index] = RTree::CalcRectArea(&buf[index].m_rect);
+    }
+
+    int seed0 = 0, seed1 = 1;
+    float worst = -numeric_limits<float>::max();
+    for (int indexA = 0; indexA < total - 1; ++indexA)
+    {
+        for (int indexB = indexA + 1; indexB < total; ++indexB)
+        {
+            Rect oneRect = RTree::CombineRect(&buf[indexA].m_rect, &buf[indexB].m_rect);
+            float waste = RTree::CalcRectArea(&oneRect) - area[indexA] - area[indexB];
+            if (waste > worst)
+            {
+                worst = waste;
+                seed0 = indexA;
+                seed1 = indexB;
+            }
+        }
+    }
+
+    auto classify = [&](int a_index, int a_group)
+    {
+        partition[a_index] = a_group;
+        cover[a_group] = count[a_group] == 0 ? buf[a_index].m_rect : RTree::CombineRect(&cover[a_group], &buf[a_index].m_rect);
+        coverArea[a_group] = RTree::CalcRectArea(&cover[a_group]);
+        ++count[a_group];
+    };
+    classify(seed0, 0);
+    classify(seed1, 1);
+
+    while (count[0] + count[1] < total
+        && count[0] < total - PAGE_MINNODES
+        && count[1] < total - PAGE_MINNODES)
+    {
+        float biggestDiff = -1;
+        int chosen = 0, betterGroup = 0;
+
+        for (int index = 0; index < total; ++index)
+        {
+            if (partition[index] != -1)
+            {
+                continue;
+            }
+
+            Rect rect0 = RTree::CombineRect(&buf[index].m_rect, &cover[0]);
+            Rect rect1 = RTree::CombineRect(&buf[index].m_rect, &cover[1]);
+            float diff = (RTree::CalcRectArea(&rect1) - coverArea[1]) - (RTree::CalcRectArea(&rect0) - coverArea[0]);
+            int group = 0;
+            if (diff < 0)
+            {
+                group = 1;
+                diff = -diff;
+            }
+
+            if (diff > biggestDiff || (diff == biggestDiff && count[group] < count[betterGroup]))
+            {
+                biggestDiff = diff;
+                chosen = index;
+                betterGroup = group;
+            }
+        }
+        classify(chosen, betterGroup);
+    }
+
+    int rest = count[0] >= total - PAGE_MINNODES ? 1 : 0;
+    for (int index = 0; index < total; ++index)
+    {
+        if (partition[index] == -1)
+        {
+            classify(index, rest);
+        }
+    }
+
+    *a_newPage = AllocPage(a_node->m_level);
+    PageNode* newNode = PinNode(*a_newPage);
+
+    a_node->m_count = 0;
+    for (int index = 0; index < total; ++index)
+    {
+        PageNode* target = partition[index] == 0 ? a_node : newNode;
+        target->m_entry[target->m_count++] = buf[index];
+    }
+    UnpinNode(*a_newPage, true);
+}
+
+
+Rect PagedRTree::NodeCover(uint32_t a_page)
+{
+    PageNode* node = PinNode(a_page);
+    Rect rect = NodeCover(node);
+    UnpinNode(a_page, false);
+    return rect;
+}
+
+
+Rect PagedRTree::NodeCover(PageNode* a_node)
+{
+    Rect rect = a_node->m_entry[0].m_rect;
+    for (int index = 1; index < a_node->m_count; ++index)
+    {
+        rect = RTree::CombineRect(&rect, &a_node->m_entry[index].m_rect);
+    }
+    return rect;
+}
+
+
+int PagedRTree::ChooseLeaf(const Rect* a_rect, PageNode* a_node)
+{
+    int best = 0;
+    float bestIncr = 0;
+    float bestArea = 0;
+
+    for (int index = 0; index < a_node->m_count; ++index)
+    {
+        Rect* curRect = &a_node->m_entry[index].m_rect;
+        Rect tempRect = RTree::CombineRect(a_rect, curRect);
+
+        float area = RTree::CalcRectArea(curRect);
+        float increase = RTree::CalcRectArea(&tempRect) - area;
+
+        if (index == 0 || increase < bestIncr || (increase == bestIncr && area < bestArea))
+        {
+            best = index;
+            bestIncr = increase;
+            bestArea = area;
+        }
+    }
+    return best;
+}
+
+
+// Returns false if no entry matched or I/O failed. The root only loses
+// levels in the collapse at the end, so every orphan still has a node at
+// its level to go back under.
+bool PagedRTree::Remove(const int a_min[2], const int a_max[2], const vector<pair<int, int>>& a_dataId)
+{
+    if (Failed())
+    {
+        return false;
+    }
+
+    Rect rect(a_min[0], a_min[1], a_max[0], a_max[1]);
+    vector<uint32_t> reInsert;
+
+    if (DeleteRec(&rect, a_dataId, m_root, reInsert))
+    {
+        return false;
+    }
+
+    vector<pair<PageEntry, int>> orphans;
+    for (unsigned int i = 0; i < reInsert.size(); ++i)
+    {
+        PageNode* node = PinNode(reInsert[i]);
+        for (int index = 0; index < node->m_count; ++index)
+        {
+            orphans.push_back(make_pair(node->m_entry[index], (int)node->m_level));
+        }
+        UnpinNode(reInsert[i], false);
+        FreePage(reInsert[i]);
+    }
+
+    for (unsigned int i = 0; i < orphans.size(); ++i)
+    {
+        InsertRect(orphans[i].first, orphans[i].second);
+    }
+
+    while (!Failed())
+    {
+        PageNode* root = PinNode(m_root);
+        if (!root->IsInternalNode() || root->m_count != 1)
+        {
+            UnpinNode(m_root, false);
+            break;
+        }
+        uint32_t child = (uint32_t)root->m_entry[0].m_ref;
+        UnpinNode(m_root, false);
+        FreePage(m_root);
+        m_root = child;
+    }
+    return !Failed();
+}
+
+
+bool PagedRTree::DeleteRec(const Rect* a_rect, const vector<pair<int, int>>& a_id, uint32_t a_page, vector<uint32_t>& a_reInsert)
+{
+    PageNode* node = PinNode(a_page);
+
+    if (node->IsInternalNode())
+    {
+        for (int index = 0; index < node->m_count; ++index)
+        {
+            if (!RTree::Overlap(a_rect, &node->m_entry[index].m_rect))
+            {
+                continue;
+            }
+
+            uint32_t child = (uint32_t)node->m_entry[index].m_ref;
+            if (!DeleteRec(a_rect, a_id, child, a_reInsert))
+            {
+                PageNode* childNode = PinNode(child);
+                int childCount = childNode->m_count;
+                UnpinNode(child, false);
+
+                if (childCount >= PAGE_MINNODES)
+                {
+                    node->m_entry[index].m_rect = NodeCover(child);
+                }
+                else
+                {
+                    a_reInsert.push_back(child);
+                    node->m_entry[index] = node->m_entry[node->m_count - 1];
+                    --node->m_count;
+                }
+                UnpinNode(a_page, true);
+                return false;
+            }
+        }
+        UnpinNode(a_page, false);
+        return true;
+    }
+
+    vector<pair<int, int>> data;
+    for (int index = 0; index < node->m_count; ++index)
+    {
+        if (!RTree::Overlap(a_rect, &node->m_entry[index].m_rect))
+        {
+            continue;
+        }
+
+        if (!ReadObject(node->m_entry[index].m_ref, data))
+        {
+            break;
+        }
+        if (data == a_id)
+        {
+            FreeObject(node->m_entry[index].m_ref, data.size());
+            node->m_entry[index] = node->m_entry[node->m_count - 1];
+            --node->m_count;
+            UnpinNode(a_page, true);
+            return false;
+        }
+    }
+    UnpinNode(a_page, false);
+    return true;
+}
+
+
+// An I/O failure leaves a_results empty; Failed() tells it from no hits.
+bool PagedRTree::Search(const Rect& a_rect, vector<vector<pair<int, int>>>& a_results)
+{
+    a_results.clear();
+    if (!Failed())
+    {
+        SearchRec(m_root, a_rect, a_results);
+    }
+    if (Failed())
+    {
+        a_results.clear();
+    }
+    return !a_results.empty();
+}
+
+
+void PagedRTree::SearchRec(uint32_t a_page, const Rect& a_rect, vector<vector<pair<int, int>>>& a_results)
+{
+    PageNode* node = PinNode(a_page);
+
+    for (int index = 0; index < node->m_count; ++index)
+    {
+        if (!RTree::Overlap(&node->m_entry[index].m_rect, &a_rect))
+        {
+            continue;
+        }
+
+        if (node->IsInternalNode())
+        {
+            SearchRec((uint32_t)node->m_entry[index].m_ref, a_rect, a_results);
+        }
+        else
+        {
+            a_results.push_back(vector<pair<int, int>>());
+            if (!ReadObject(node->m_entry[index].m_ref, a_results.back()))
+            {
+                break;
+            }
+        }
+    }
+    UnpinNode(a_page, false);
+}
+
+
+// -1 on I/O failure.
+int PagedRTree::Count()
+{
+    int count = 0;
+    if (!Failed())
+    {
+        CountRec(m_root, count);
+    }
+    return Failed() ? -1 : count;
+}
+
+
+void PagedRTree::CountRec(uint32_t a_page, int& a_count)
+{
+    PageNode* node = PinNode(a_page);
+
+    if (node->IsInternalNode())
+    {
+        for (int index = 0; index < node->m_count; ++index)
+        {
+            CountRec((uint32_t)node->m_entry[index].m_ref, a_count);
+        }
+    }
+    else
+    {
+        a_count += node->m_count;
+    }
+    UnpinNode(a_page, false);
+}
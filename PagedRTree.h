@@ -0,0 +1,150 @@
+#ifndef PAGEDRTREE_H
+#define PAGEDRTREE_H
+
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+
+#include "RTree.h"
+
+#define RTREE_PAGE_SIZE 4096
+#define DATA_CLASSES 32   // data-file slot sizes: 1, 2, 4, ... 2^31 vertices
+
+
+struct PageEntry
+{
+    Rect m_rect;
+    uint64_t m_ref;   // child page id, or object offset in the data file at a leaf
+};
+
+#define PAGE_MAXNODES ((int)((RTREE_PAGE_SIZE - 2 * sizeof(int32_t)) / sizeof(PageEntry)))
+#define PAGE_MINNODES (PAGE_MAXNODES * 2 / 5)
+
+struct PageNode
+{
+    bool IsInternalNode() { return (m_level > 0); }
+    bool IsLeaf() { return (m_level == 0); }
+
+    int32_t m_count;
+    int32_t m_level;
+    PageEntry m_entry[PAGE_MAXNODES];
+};
+
+
+// Fixed pool of page frames over one file. Pages are pinned while in use;
+// an unpinned page is evicted by the CLOCK hand and written back only if it
+// was dirtied. A failed open, read or write, or a Pin with every frame
+// pinned, puts the pool in a failed state that Failed() reports.
+class BufferPool
+{
+public:
+
+    BufferPool(const string& a_path, int a_frames);
+    BufferPool(const BufferPool& other) = delete;
+    virtual ~BufferPool();
+
+    BufferPool& operator=(const BufferPool& other) = delete;
+
+    char* Pin(uint32_t a_page);
+    void Unpin(uint32_t a_page, bool a_dirty);
+    bool Flush();
+    bool Failed() const;
+
+    void ResetStats();
+    long long Faults() const;
+    long long Writes() const;
+    long long Hits() const;
+
+
+protected:
+
+    struct Frame
+    {
+        uint32_t m_page;
+        int m_pinCount;
+        bool m_dirty;
+        bool m_referenced;
+        bool m_valid;
+        vector<char> m_data;
+    };
+
+    int Victim();
+    bool WriteBack(Frame* a_frame);
+    char* Scratch();
+
+    int m_fd;
+    bool m_failed;
+    vector<char> m_scratch;
+    vector<Frame> m_frames;
+    unordered_map<uint32_t, int> m_pageTable;
+    int m_clockHand;
+
+    long long m_faults;
+    long long m_writes;
+    long long m_hits;
+};
+
+
+// Guttman R-tree whose nodes are pages in <path>; polygons go to slots in
+// <path>.dat and leaf entries hold their offset. Page 0 keeps the root id,
+// the page count, the head of the free-page list, and the end and free-slot
+// lists of the data file.
+class PagedRTree
+{
+public:
+
+    PagedRTree(const string& a_path, int a_poolFrames);
+    PagedRTree(const PagedRTree& other) = delete;
+    virtual ~PagedRTree();
+
+    PagedRTree& operator=(const PagedRTree& other) = delete;
+
+    bool Insert(const int a_min[2], const int a_max[2], vector<pair<int, int>>& a_dataId);
+    bool Remove(const int a_min[2], const int a_max[2], const vector<pair<int, int>>& a_dataId);
+
+    bool Search(const Rect& a_rect, vector<vector<pair<int, int>>>& a_results);
+
+    int Count();
+    bool Failed() const;
+
+    BufferPool& Pool();
+
+
+protected:
+
+    PageNode* PinNode(uint32_t a_page);
+    void UnpinNode(uint32_t a_page, bool a_dirty);
+    uint32_t AllocPage(int a_level);
+    void FreePage(uint32_t a_page);
+    void WriteMeta();
+
+    int DataClass(size_t a_vertices) const;
+    uint64_t WriteObject(const vector<pair<int, int>>& a_data);
+    void FreeObject(uint64_t a_offset, size_t a_vertices);
+    bool ReadObject(uint64_t a_offset, vector<pair<int, int>>& a_data);
+
+    bool InsertRec(const PageEntry& a_entry, uint32_t a_page, uint32_t* a_newPage, int a_level);
+    void InsertRect(const PageEntry& a_entry, int a_level);
+    bool AddEntry(const PageEntry& a_entry, PageNode* a_node, uint32_t* a_newPage);
+    void SplitNode(PageNode* a_node, const PageEntry& a_entry, uint32_t* a_newPage);
+    Rect NodeCover(uint32_t a_page);
+    Rect NodeCover(PageNode* a_node);
+    int ChooseLeaf(const Rect* a_rect, PageNode* a_node);
+
+    bool DeleteRec(const Rect* a_rect, const vector<pair<int, int>>& a_id, uint32_t a_page, vector<uint32_t>& a_reInsert);
+    void SearchRec(uint32_t a_page, const Rect& a_rect, vector<vector<pair<int, int>>>& a_results);
+    void CountRec(uint32_t a_page, int& a_count);
+
+    BufferPool* m_pool;
+    int m_dataFd;
+    uint64_t m_dataEnd;
+    uint64_t m_dataFree[DATA_CLASSES];
+    bool m_failed;
+
+    uint32_t m_root;
+    uint32_t m_pageCount;
+    uint32_t m_freeHead;
+};
+
+#endif
@@ -0,0 +1,561 @@
+#include "PointRTree.h"
+
+PointRTree::PointRTree()
+{
+    m_root = AllocNode();
+    m_root->m_level = 0;
+}
+
+
+PointRTree::PointRTree(const PointRTree& other) : PointRTree()
+{
+    CopyRec(m_root, other.m_root);
+}
+
+
+PointRTree::~PointRTree()
+{
+    RemoveAllRec(m_root);
+}
+
+
+PointRTree& PointRTree::operator=(const PointRTree& other)
+{
+    if (this != &other)
+    {
+        RemoveAllRec(m_root);
+        m_root = AllocNode();
+        CopyRec(m_root, other.m_root);
+    }
+    return *this;
+}
+
+
+void PointRTree::Insert(int a_x, int a_y, int a_id)
+{
+    PointEntry entry;
+    entry.m_x = a_x;
+    entry.m_y = a_y;
+    entry.m_id = a_id;
+
+    InsertEntry(&entry);
+}
+
+
+bool PointRTree::Remove(int a_x, int a_y, int a_id)
+{
+    PointEntry entry;
+    entry.m_x = a_x;
+    entry.m_y = a_y;
+    entry.m_id = a_id;
+
+    vector<PointNode*> reInsert;
+
+    if (DeleteRec(&entry, m_root, reInsert))
+    {
+        return false;
+    }
+
+    vector<PointEntry> orphans;
+    for (unsigned int i = 0; i < reInsert.size(); ++i)
+    {
+        PointNode* tempNode = reInsert[i];
+        for (int index = 0; index < tempNode->m_count; ++index)
+        {
+            orphans.push_back(tempNode->m_entry[index]);
+        }
+        FreeNode(tempNode);
+    }
+
+    if (m_root->IsInternalNode() && m_root->m_count == 0)
+    {
+        m_root->m_level = 0;
+    }
+
+    for (unsigned int i = 0; i < orphans.size(); ++i)
+    {
+        InsertEntry(&orphans[i]);
+    }
+
+    while (m_root->IsInternalNode() && m_root->m_count == 1)
+    {
+        PointNode* tempNode = m_root->m_branch[0].m_child;
+        FreeNode(m_root);
+        m_root = tempNode;
+    }
+
+    return true;
+}
+
+
+void PointRTree::RemoveAll()
+{
+    RemoveAllRec(m_root);
+
+    m_root = AllocNode();
+    m_root->m_level = 0;
+}
+
+
+bool PointRTree::Search(const Rect& a_rect, vector<PointEntry>& a_results)
+{
+    a_results.clear();
+    SearchRec(m_root, a_rect, a_results);
+    return !a_results.empty();
+}
+
+
+int PointRTree::Count()
+{
+    int count = 0;
+    CountRec(m_root, count);
+
+    return count;
+}
+
+
+// Same breakdown as RTree::MemoryUsage. Leaf entries live inside the nodes,
+// so there is no payload or object store, and unused slots are counted in
+// entries for leaves and in branches for internal nodes.
+MemoryStats PointRTree::MemoryUsage()
+{
+    MemoryStats stats;
+    stats.m_nodeBytes.assign(m_root->m_level + 1, 0);
+    stats.m_leafPayloadBytes = 0;
+    stats.m_objectStoreBytes = 0;
+    stats.m_unusedSlotBytes = 0;
+    stats.m_slackBytes = 0;
+    stats.m_pathCacheBytes = 0;
+
+    MemoryRec(m_root, stats);
+
+    stats.m_peakBytes = stats.Total();
+    return stats;
+}
+
+
+PointNode* PointRTree::AllocNode()
+{
+    PointNode* newNode = new PointNode;
+    newNode->m_count = 0;
+    newNode->m_level = -1;
+    return newNode;
+}
+
+
+void PointRTree::FreeNode(PointNode* a_node)
+{
+    delete a_node;
+}
+
+
+void PointRTree::RemoveAllRec(PointNode* a_node)
+{
+    if (a_node->IsInternalNode())
+    {
+        for (int index = 0; index < a_node->m_count; ++index)
+        {
+            RemoveAllRec(a_node->m_branch[index].m_child);
+        }
+    }
+    FreeNode(a_node);
+}
+
+
+void PointRTree::CopyRec(PointNode* current, PointNode* other)
+{
+    current->m_level = other->m_level;
+    current->m_count = other->m_count;
+
+    if (current->IsInternalNode())
+    {
+        for (int index = 0; index < current->m_count; ++index)
+        {
+            current->m_branch[index].m_rect = other->m_branch[index].m_rect;
+            current->m_branch[index].m_child = AllocNode();
+            CopyRec(current->m_branch[index].m_child, other->m_branch[index].m_child);
+        }
+    }
+    else
+    {
+        for (int index = 0; index < current->m_count; ++index)
+        {
+            current->m_entry[index] = other->m_entry[index];
+        }
+    }
+}
+
+
+void PointRTree::MemoryRec(PointNode* a_node, MemoryStats& a_stats)
+{
+    a_stats.m_nodeBytes[a_node->m_level] += sizeof(PointNode);
+
+    if (a_node->IsLeaf())
+    {
+        a_stats.m_unusedSlotBytes += (POINT_MAXLEAF + 1 - a_node->m_count) * sizeof(PointEntry);
+        return;
+    }
+
+    a_stats.m_unusedSlotBytes += (MAXNODES + 1 - a_node->m_count) * sizeof(PointBranch);
+    for (int index = 0; index < a_node->m_count; ++index)
+    {
+        MemoryRec(a_node->m_branch[index].m_child, a_stats);
+    }
+}
+
+
+void PointRTree::CountRec(PointNode* a_node, int& a_count)
+{
+    if (a_node->IsInternalNode())
+    {
+        for (int index = 0; index < a_node->m_count; ++index)
+        {
+            CountRec(a_node->m_branch[index].m_child, a_count);
+        }
+    }
+    else
+    {
+        a_count += a_node->m_count;
+    }
+}
+
+
+void PointRTree::InsertEntry(const PointEntry* a_entry)
+{
+    PointNode* newNode;
+
+    if (InsertRec(a_entry, m_root, &newNode))
+    {
+        PointNode* newRoot = AllocNode();
+        newRoot->m_level = m_root->m_level + 1;
+
+        newRoot->m_branch[0].m_rect = NodeCover(m_root);
+        newRoot->m_branch[0].m_child = m_root;
+        newRoot->m_branch[1].m_rect = NodeCover(newNode);
+        newRoot->m_branch[1].m_child = newNode;
+        newRoot->m_count = 2;
+
+        m_root = newRoot;
+    }
+}
+
+
+bool PointRTree::InsertRec(const PointEntry* a_entry, PointNode* a_node, PointNode** a_newNode)
+{
+    if (a_node->IsInternalNode())
+    {
+        Rect rect = EntryRect(a_entry);
+        PointNode* otherNode;
+
+        int index = ChooseSubtree(&rect, a_node);
+
+        if (!InsertRec(a_entry, a_node->m_branch[index].m_child, &otherNode))
+        {
+            a_node->m_branch[index].m_rect = RTree::CombineRect(&rect, &a_node->m_branch[index].m_rect);
+            return false;
+        }
+
+        a_node->m_branch[index].m_rect = NodeCover(a_node->m_branch[index].m_child);
+
+        PointBranch branch;
+        branch.m_rect = NodeCover(otherNode);
+        branch.m_child = otherNode;
+
+        if (a_node->m_count < MAXNODES)
+        {
+            a_node->m_branch[a_node->m_count++] = branch;
+            return false;
+        }
+        SplitInternal(a_node, &branch, a_newNode);
+        return true;
+    }
+
+    if (a_node->m_count < POINT_MAXLEAF)
+    {
+        a_node->m_entry[a_node->m_count++] = *a_entry;
+        return false;
+    }
+    SplitLeaf(a_node, a_entry, a_newNode);
+    return true;
+}
+
+
+Rect PointRTree::EntryRect(const PointEntry* a_entry)
+{
+    return Rect(a_entry->m_x, a_entry->m_y, a_entry->m_x, a_entry->m_y);
+}
+
+
+Rect PointRTree::NodeCover(PointNode* a_node)
+{
+    if (a_node->IsLeaf())
+    {
+        Rect rect = EntryRect(&a_node->m_entry[0]);
+        for (int index = 1; index < a_node->m_count; ++index)
+        {
+            Rect entryRect = EntryRect(&a_node->m_entry[index]);
+            rect = RTree::CombineRect(&rect, &entryRect);
+        }
+        return rect;
+    }
+
+    Rect rect = a_node->m_branch[0].m_rect;
+    for (int index = 1; index < a_node->m_count; ++index)
+    {
+        rect = RTree::CombineRect(&rect, &a_node->m_branch[index].m_rect);
+    }
+    return rect;
+}
+
+
+int PointRTree::ChooseSubtree(const Rect* a_rect, PointNode* a_node)
+{
+    int best = 0;
+    float bestIncr = 0;
+    float bestArea = 0;
+
+    for (int index = 0; index < a_node->m_count; ++index)
+    {
+        Rect* curRect = &a_node->m_branch[index].m_rect;
+        Rect tempRect = RTree::CombineRect(a_rect, curRect);
+
+        float area = RTree::CalcRectArea(curRect);
+        float increase = RTree::CalcRectArea(&tempRect) - area;
+
+        if (index == 0 || increase < bestIncr || (increase == bestIncr && area < bestArea))
+        {
+            best = index;
+            bestIncr = increase;
+            bestArea = area;
+        }
+    }
+    return best;
+}
+
+
+// Points have no area, so the quadratic split has nothing to minimize.
+// Cut along the axis with the larger spread instead, at the median.
+void PointRTree::SplitLeaf(PointNode* a_node, const PointEntry* a_entry, PointNode** a_newNode)
+{
+    PointEntry buf[POINT_MAXLEAF + 1];
+    int total = POINT_MAXLEAF + 1;
+
+    for (int index = 0; index < POINT_MAXLEAF; ++index)
+    {
+        buf[index] = a_node->m_entry[index];
+    }
+    buf[POINT_MAXLEAF] = *a_entry;
+
+    int minX = buf[0].m_x, maxX = buf[0].m_x;
+    int minY = buf[0].m_y, maxY = buf[0].m_y;
+    for (int index = 1; index < total; ++index)
+    {
+        minX = Min(minX, buf[index].m_x);
+        maxX = Max(maxX, buf[index].m_x);
+        minY = Min(minY, buf[index].m_y);
+        maxY = Max(maxY, buf[index].m_y);
+    }
+
+    if ((long long)maxX - minX >= (long long)maxY - minY)
+    {
+        sort(buf, buf + total, [](const PointEntry& a, const PointEntry& b) { return a.m_x < b.m_x; });
+    }
+    else
+    {
+        sort(buf, buf + total, [](const PointEntry& a, const PointEntry& b) { return a.m_y < b.m_y; });
+    }
+
+    *a_newNode = AllocNode();
+    (*a_newNode)->m_level = 0;
+
+    int half = total / 2;
+    a_node->m_count = 0;
+    for (int index = 0; index < half; ++index)
+    {
+        a_node->m_entry[a_node->m_count++] = buf[index];
+    }
+    for (int index = half; index < total; ++index)
+    {
+        (*a_newNode)->m_entry[(*a_newNode)->m_count++] = buf[index];
+    }
+}
+
+
+// Branches do have area, so this is the R*-tree split: sort the branches
+// by lower and by upper edge on each axis, try every cut that leaves both
+// nodes at least MINNODES, and keep the one whose two covers overlap least;
+// ties go to the smaller total area, then the smaller total margin.
+void PointRTree::SplitInternal(PointNode* a_node, const PointBranch* a_branch, PointNode** a_newNode)
+{
+    PointBranch buf[MAXNODES + 1];
+    int total = MAXNODES + 1;
+
+    for (int index = 0; index < MAXNODES; ++index)
+    {
+        buf[index] = a_node->m_branch[index];
+    }
+    buf[MAXNODES] = *a_branch;
+
+    PointBranch best[MAXNODES + 1];
+    int bestCut = -1;
+    double bestOverlap = 0, bestArea = 0, bestMargin = 0;
+
+    for (int axis = 0; axis < 2; ++axis)
+    {
+        for (int upper = 0; upper < 2; ++upper)
+        {
+            sort(buf, buf + total, [axis, upper](const PointBranch& a, const PointBranch& b)
+            {
+                return upper ? a.m_rect.m_max[axis] < b.m_rect.m_max[axis] : a.m_rect.m_min[axis] < b.m_rect.m_min[axis];
+            });
+
+            for (int cut = MINNODES; cut <= total - MINNODES; ++cut)
+            {
+                Rect low = buf[0].m_rect;
+                for (int index = 1; index < cut; ++index)
+                {
+                    low = RTree::CombineRect(&low, &buf[index].m_rect);
+                }
+                Rect high = buf[cut].m_rect;
+                for (int index = cut + 1; index < total; ++index)
+                {
+                    high = RTree::CombineRect(&high, &buf[index].m_rect);
+                }
+
+                double overlap = 0;
+                if (RTree::Overlap(&low, &high))
+                {
+                    Rect inter;
+                    for (int k = 0; k < 2; ++k)
+                    {
+                        inter.m_min[k] = Max(low.m_min[k], high.m_min[k]);
+                        inter.m_max[k] = Min(low.m_max[k], high.m_max[k]);
+                    }
+                    overlap = RTree::CalcRectArea(&inter);
+                }
+                double area = (double)RTree::CalcRectArea(&low) + RTree::CalcRectArea(&high);
+                double margin = (double)low.m_max[0] - low.m_min[0] + low.m_max[1] - low.m_min[1] +
+                    high.m_max[0] - high.m_min[0] + high.m_max[1] - high.m_min[1];
+
+                if (bestCut < 0 || overlap < bestOverlap || (overlap == bestOverlap &&
+                    (area < bestArea || (area == bestArea && margin < bestMargin))))
+                {
+                    bestCut = cut;
+                    bestOverlap = overlap;
+                    bestArea = area;
+                    bestMargin = margin;
+                    copy(buf, buf + total, best);
+                }
+            }
+        }
+    }
+
+    *a_newNode = AllocNode();
+    (*a_newNode)->m_level = a_node->m_level;
+
+    a_node->m_count = 0;
+    for (int index = 0; index < bestCut; ++index)
+    {
+        a_node->m_branch[a_node->m_count++] = best[index];
+    }
+    for (int index = bestCut; index < total; ++index)
+    {
+        (*a_newNode)->m_branch[(*a_newNode)->m_count++] = best[index];
+    }
+}
+
+
+bool PointRTree::DeleteRec(const PointEntry* a_entry, PointNode* a_node, vector<PointNode*>& a_reInsert)
+{
+    if (a_node->IsInternalNode())
+    {
+        for (int index = 0; index < a_node->m_count; ++index)
+        {
+            PointBranch* branch = &a_node->m_branch[index];
+            if (!Contains(&branch->m_rect, a_entry->m_x, a_entry->m_y))
+            {
+                continue;
+            }
+            if (!DeleteRec(a_entry, branch->m_child, a_reInsert))
+            {
+                int minFill = branch->m_child->IsLeaf() ? POINT_MINLEAF : MINNODES;
+                if (branch->m_child->m_count >= minFill)
+                {
+                    branch->m_rect = NodeCover(branch->m_child);
+                }
+                else
+                {
+                    CollectLeaves(branch->m_child, a_reInsert);
+                    a_node->m_branch[index] = a_node->m_branch[a_node->m_count - 1];
+                    --a_node->m_count;
+                }
+                return false;
+            }
+        }
+        return true;
+    }
+    else
+    {
+        for (int index = 0; index < a_node->m_count; ++index)
+        {
+            PointEntry* entry = &a_node->m_entry[index];
+            if (entry->m_x == a_entry->m_x && entry->m_y == a_entry->m_y && entry->m_id == a_entry->m_id)
+            {
+                a_node->m_entry[index] = a_node->m_entry[a_node->m_count - 1];
+                --a_node->m_count;
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+
+void PointRTree::CollectLeaves(PointNode* a_node, vector<PointNode*>& a_leaves)
+{
+    if (a_node->IsInternalNode())
+    {
+        for (int index = 0; index < a_node->m_count; ++index)
+        {
+            CollectLeaves(a_node->m_branch[index].m_child, a_leaves);
+        }
+        FreeNode(a_node);
+    }
+    else
+    {
+        a_leaves.push_back(a_node);
+    }
+}
+
+
+bool PointRTree::Contains(const Rect* a_rect, int a_x, int a_y) const
+{
+    return a_rect->m_min[0] <= a_x && a_x <= a_rect->m_max[0] &&
+        a_rect->m_min[1] <= a_y && a_y <= a_rect->m_max[1];
+}
+
+
+void PointRTree::SearchRec(PointNode* a_node, const Rect& a_rect, vector<PointEntry>& a_results)
+{
+    if (a_node->IsInternalNode())
+    {
+        for (int index = 0; index < a_node->m_count; ++index)
+        {
+            if (RTree::Overlap(&a_node->m_branch[index].m_rect, &a_rect))
+            {
+                SearchRec(a_node->m_branch[index].m_child, a_rect, a_results);
+            }
+        }
+    }
+    else
+    {
+        for (int index = 0; index < a_node->m_count; ++index)
+        {
+            const PointEntry& entry = a_node->m_entry[index];
+            if (Contains(&a_rect, entry.m_x, entry.m_y))
+            {
+                a_results.push_back(entry);
+            }
+        }
+    }
+}
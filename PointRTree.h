@@ -0,0 +1,91 @@
+#ifndef POINTRTREE_H
+#define POINTRTREE_H
+
+#include "RTree.h"
+
+#define POINT_MAXLEAF (2 * MAXNODES + 1)
+#define POINT_MINLEAF (POINT_MAXLEAF / 2)
+
+
+struct PointEntry
+{
+    int m_x;
+    int m_y;
+    int m_id;
+};
+
+struct PointNode;
+
+struct PointBranch
+{
+    Rect m_rect;
+    PointNode* m_child;
+};
+
+// A leaf packs (x, y, id) triples into the same bytes an internal node uses
+// for its branches, so it holds twice as many entries.
+struct PointNode
+{
+    PointNode() {}
+
+    bool IsInternalNode() { return (m_level > 0); }
+    bool IsLeaf() { return (m_level == 0); }
+
+    int m_count;
+    int m_level;
+    union
+    {
+        PointBranch m_branch[MAXNODES + 1];
+        PointEntry m_entry[POINT_MAXLEAF + 1];
+    };
+};
+
+
+class PointRTree
+{
+public:
+
+    PointRTree();
+    PointRTree(const PointRTree& other);
+    virtual ~PointRTree();
+
+    PointRTree& operator=(const PointRTree& other);
+
+    void Insert(int a_x, int a_y, int a_id);
+    bool Remove(int a_x, int a_y, int a_id);
+    void RemoveAll();
+
+    bool Search(const Rect& a_rect, vector<PointEntry>& a_results);
+
+    int Count();
+
+    MemoryStats MemoryUsage();
+
+
+protected:
+
+    PointNode* AllocNode();
+    void FreeNode(PointNode* a_node);
+    void RemoveAllRec(PointNode* a_node);
+    void CopyRec(PointNode* current, PointNode* other);
+    void CountRec(PointNode* a_node, int& a_count);
+    void MemoryRec(PointNode* a_node, MemoryStats& a_stats);
+
+    bool InsertRec(const PointEntry* a_entry, PointNode* a_node, PointNode** a_newNode);
+    void InsertEntry(const PointEntry* a_entry);
+    Rect EntryRect(const PointEntry* a_entry);
+    Rect NodeCover(PointNode* a_node);
+    int ChooseSubtree(const Rect* a_rect, PointNode* a_node);
+    void SplitLeaf(PointNode* a_node, const PointEntry* a_entry, PointNode** a_newNode);
+    void SplitInternal(PointNode* a_node, const PointBranch* a_branch, PointNode** a_newNode);
+    bool DeleteRec(const PointEntry* a_entry, PointNode* a_node, vector<PointNode*>& a_reInsert);
+    void CollectLeaves(PointNode* a_node, vector<PointNode*>& a_leaves);
+
+    bool Contains(const Rect* a_rect, int a_x, int a_y) const;
+
+    void SearchRec(PointNode* a_node, const Rect& a_rect, vector<PointEntry>& a_results);
+
+    PointNode* m_root;
+};
+
+#endif
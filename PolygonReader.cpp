@@ -0,0 +1,381 @@
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <climits>
+#include <fstream>
+#include <thread>
+
+#include "PolygonReader.h"
+
+static_assert(sizeof(pair<int, int>) == 2 * sizeof(int32_t), "binary records are read straight into vertex lists");
+
+
+PolygonReader::PolygonReader(int a_threads, size_t a_chunkBytes)
+{
+    m_threads = Max(a_threads, 1);
+    m_chunkBytes = Max(a_chunkBytes, (size_t)4096);
+}
+
+
+PolygonReader::~PolygonReader()
+{
+}
+
+
+// Same box as RTree::MBR (a lone vertex gets a 10 x 10 box around it), so
+// objects loaded here can be removed with the MBR callers compute. The loop
+// keeps no branches and only independent min/max chains, which the compiler
+// turns into packed min/max over several vertices at a time.
+Rect PolygonReader::PolygonMBR(const pair<int, int>* a_points, size_t a_count)
+{
+    int minX = a_points[0].first, maxX = minX;
+    int minY = a_points[0].second, maxY = minY;
+
+    if (a_count == 1)
+    {
+        return Rect(minX - 5, minY - 5, maxX + 5, maxY + 5);
+    }
+
+    for (size_t i = 1; i < a_count; ++i)
+    {
+        int x = a_points[i].first;
+        int y = a_points[i].second;
+        minX = x < minX ? x : minX;
+        maxX = x > maxX ? x : maxX;
+        minY = y < minY ? y : minY;
+        maxY = y > maxY ? y : maxY;
+    }
+    return Rect(minX, minY, maxX, maxY);
+}
+
+
+bool PolygonReader::WriteBinary(const string& a_path, const vector<vector<pair<int, int>>>& a_polygons)
+{
+    ofstream out(a_path, ios::binary | ios::trunc);
+    uint32_t magic = POLYGON_MAGIC;
+    out.write((const char*)&magic, sizeof(magic));
+
+    for (unsigned int i = 0; i < a_polygons.size(); ++i)
+    {
+        uint32_t count = (uint32_t)a_polygons[i].size();
+        out.write((const char*)&count, sizeof(count));
+        out.write((const char*)a_polygons[i].data(), count * sizeof(pair<int, int>));
+    }
+    return (bool)out;
+}
+
+
+// First record boundary at or after a_target, starting from the known
+// boundary a_from. CSV records end at '\n'; binary ones have to be hopped
+// over one length prefix at a time, which ParseChunk overlaps with parsing.
+const char* PolygonReader::Boundary(const char* a_from, const char* a_target, const char* a_end, PolygonFormat a_format) const
+{
+    if (a_target >= a_end)
+    {
+        return a_end;
+    }
+
+    if (a_format == POLYGON_CSV)
+    {
+        if (a_target <= a_from || a_target[-1] == '\n')
+        {
+            return Max(a_from, a_target);
+        }
+        const char* newline = (const char*)memchr(a_target, '\n', a_end - a_target);
+        return newline ? newline + 1 : a_end;
+    }
+
+    const char* pos = a_from;
+    while (pos < a_target)
+    {
+        uint32_t count;
+        if (a_end - pos < (ptrdiff_t)sizeof(count))
+        {
+            return a_end;
+        }
+        memcpy(&count, pos, sizeof(count));
+
+        size_t length = sizeof(count) + (size_t)count * sizeof(pair<int, int>);
+        if ((size_t)(a_end - pos) < length)
+        {
+            return a_end;
+        }
+        pos += length;
+    }
+    return pos;
+}
+
+
+void PolygonReader::ParseSlice(const char* a_begin, const char* a_end, PolygonFormat a_format, vector<Branch>& a_out, long long& a_skipped) const
+{
+    Branch branch;
+    branch.m_child = NULL;
+
+    if (a_format == POLYGON_BINARY)
+    {
+        const char* pos = a_begin;
+        while (pos < a_end)
+        {
+            uint32_t count = 0;
+            size_t length = sizeof(count);
+            if (a_end - pos >= (ptrdiff_t)sizeof(count))
+            {
+                memcpy(&count, pos, sizeof(count));
+                length += (size_t)count * sizeof(pair<int, int>);
+            }
+            if (count == 0 || (size_t)(a_end - pos) < length)
+            {
+                // A zero-length record is skipped; a truncated one ends the file.
+                ++a_skipped;
+                pos = count == 0 ? pos + length : a_end;
+                continue;
+            }
+
+            branch.m_data.resize(count);
+            memcpy((void*)branch.m_data.data(), pos + sizeof(count), count * sizeof(pair<int, int>));
+            branch.m_rect = PolygonMBR(branch.m_data.data(), count);
+            a_out.push_back(branch);
+            pos += length;
+        }
+        return;
+    }
+
+    const char* pos = a_begin;
+    while (pos < a_end)
+    {
+        const char* eol = (const char*)memchr(pos, '\n', a_end - pos);
+        if (!eol)
+        {
+            eol = a_end;
+        }
+
+        branch.m_data.clear();
+        bool valid = true;
+        int values = 0;
+        int x = 0;
+
+        while (pos < eol)
+        {
+            char c = *pos;
+            if (c == ' ' || c == ',' || c == ';' || c == '\t' || c == '\r')
+            {
+                ++pos;
+                continue;
+            }
+
+            bool negative = (c == '-');
+            if (c == '-' || c == '+')
+            {
+                ++pos;
+            }
+            if (pos == eol || *pos < '0' || *pos > '9')
+            {
+                valid = false;
+                break;
+            }
+
+            // Values outside int make the line invalid rather than wrap.
+            long long value = 0;
+            while (pos < eol && *pos >= '0' && *pos <= '9')
+            {
+                value = Min(value * 10 + (*pos - '0'), (long long)INT_MAX + 2);
+                ++pos;
+            }
+            if (negative)
+            {
+                value = -value;
+            }
+            if (value > INT_MAX || value < INT_MIN)
+            {
+                valid = false;
+                break;
+            }
+
+            if (values++ % 2 == 0)
+            {
+                x = (int)value;
+            }
+            else
+            {
+                branch.m_data.push_back(make_pair(x, (int)value));
+            }
+        }
+
+        if (!valid || values % 2 != 0)
+        {
+            ++a_skipped;
+        }
+        else if (!branch.m_data.empty())
+        {
+            branch.m_rect = PolygonMBR(branch.m_data.data(), branch.m_data.size());
+            a_out.push_back(branch);
+        }
+        pos = eol + 1;
+    }
+}
+
+
+// Parses the chunk of about m_chunkBytes that starts at a_begin, one slice
+// per thread, and sets a_next to where it ends. Each slice's worker starts
+// as soon as the scan for record boundaries has passed the slice's end, so
+// hopping over binary length prefixes runs alongside the parsing instead of
+// ahead of it. a_out gets the polygons in file order.
+void PolygonReader::ParseChunk(const char* a_begin, const char* a_end, PolygonFormat a_format, vector<Branch>& a_out, long long& a_skipped, const char*& a_next) const
+{
+    size_t chunk = Min((size_t)(a_end - a_begin), m_chunkBytes);
+    size_t slice = chunk / m_threads + 1;
+
+    vector<vector<Branch>> parsed(m_threads);
+    vector<long long> skipped(m_threads, 0);
+
+    vector<thread> threads;
+    const char* cut = a_begin;
+    for (int t = 0; t + 1 < m_threads; ++t)
+    {
+        const char* next = Boundary(cut, a_begin + Min((t + 1) * slice, chunk), a_end, a_format);
+        threads.push_back(thread(&PolygonReader::ParseSlice, this, cut, next, a_format, ref(parsed[t]), ref(skipped[t])));
+        cut = next;
+    }
+    a_next = Boundary(cut, a_begin + chunk, a_end, a_format);
+    ParseSlice(cut, a_next, a_format, parsed[m_threads - 1], skipped[m_threads - 1]);
+    for (unsigned int t = 0; t < threads.size(); ++t)
+    {
+        threads[t].join();
+    }
+
+    a_out.swap(parsed[0]);
+    a_skipped += skipped[0];
+    for (int t = 1; t < m_threads; ++t)
+    {
+        a_out.insert(a_out.end(), make_move_iterator(parsed[t].begin()), make_move_iterator(parsed[t].end()));
+        a_skipped += skipped[t];
+    }
+}
+
+
+bool PolygonReader::Load(const string& a_path, PolygonFormat a_format, const function<void(vector<Branch>&)>& a_sink, LoadStats* a_stats)
+{
+    auto started = chrono::steady_clock::now();
+    LoadStats stats = LoadStats();
+
+    int fd = open(a_path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) < 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    size_t size = (size_t)info.st_size;
+    char* data = NULL;
+    if (size > 0)
+    {
+        data = (char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            close(fd);
+            return false;
+        }
+        madvise(data, size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    const char* begin = data;
+    const char* end = data + size;
+
+    if (a_format == POLYGON_BINARY)
+    {
+        uint32_t magic = 0;
+        if (size >= sizeof(magic))
+        {
+            memcpy(&magic, begin, sizeof(magic));
+        }
+        if (magic != POLYGON_MAGIC)
+        {
+            if (data)
+            {
+                munmap(data, size);
+            }
+            return false;
+        }
+        begin += sizeof(magic);
+    }
+
+    // The chunk after `ready` is scanned and parsed on its own thread while
+    // the sink consumes `ready`; mapped pages the sink is done with are
+    // dropped.
+    vector<Branch> ready, parsing;
+    long long skipped = 0;
+    const char* pos = begin;
+    const char* released = data;
+    long pageSize = sysconf(_SC_PAGESIZE);
+
+    while (pos < end || !ready.empty())
+    {
+        const char* next = pos;
+        thread parser;
+        if (pos < end)
+        {
+            parser = thread(&PolygonReader::ParseChunk, this, pos, end, a_format, ref(parsing), ref(skipped), ref(next));
+        }
+
+        if (!ready.empty())
+        {
+            auto sinkStart = chrono::steady_clock::now();
+            stats.m_polygons += ready.size();
+            a_sink(ready);
+            ready.clear();
+            stats.m_sinkMs += chrono::duration<double, milli>(chrono::steady_clock::now() - sinkStart).count();
+
+            const char* upto = data + ((pos - data) / pageSize) * pageSize;
+            if (upto > released)
+            {
+                madvise((void*)released, upto - released, MADV_DONTNEED);
+                released = upto;
+            }
+        }
+
+        if (parser.joinable())
+        {
+            auto waitStart = chrono::steady_clock::now();
+            parser.join();
+            stats.m_parseMs += chrono::duration<double, milli>(chrono::steady_clock::now() - waitStart).count();
+        }
+
+        ready.swap(parsing);
+        parsing.clear();
+        pos = next;
+    }
+
+    if (data)
+    {
+        munmap(data, size);
+    }
+
+    stats.m_skipped = skipped;
+    stats.m_bytes = (long long)size;
+    stats.m_totalMs = chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+    if (a_stats)
+    {
+        *a_stats = stats;
+    }
+    return true;
+}
+
+
+// Batches go into the tree through RTree::InsertBatch: Hilbert order of
+// their MBR centers with the path cache on, so consecutive inserts reuse
+// most of the previous descent.
+bool PolygonReader::Load(const string& a_path, PolygonFormat a_format, RTree& a_index, LoadStats* a_stats)
+{
+    return Load(a_path, a_format, [&a_index](vector<Branch>& a_batch) { a_index.InsertBatch(a_batch); }, a_stats);
+}
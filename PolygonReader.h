@@ -0,0 +1,61 @@
+#ifndef POLYGONREADER_H
+#define POLYGONREADER_H
+
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+
+#include "RTree.h"
+
+#define POLYGON_MAGIC 0x594c4f50   // "POLY"
+
+
+enum PolygonFormat
+{
+    POLYGON_CSV,      // one polygon per line, "x y, x y, ..." (',' ';' and blanks all separate)
+    POLYGON_BINARY    // POLYGON_MAGIC, then per polygon a uint32 vertex count and that many int32 (x, y)
+};
+
+struct LoadStats
+{
+    long long m_polygons;
+    long long m_skipped;
+    long long m_bytes;
+    double m_parseMs;    // time the sink sat waiting for a parsed chunk
+    double m_sinkMs;
+    double m_totalMs;
+};
+
+
+// Streams polygons out of a memory-mapped file in chunks of about
+// a_chunkBytes. Each chunk is cut at record boundaries into one slice per
+// thread; slices are parsed and given their MBRs in parallel, and the batch
+// goes to the sink while the next chunk is being parsed, so at most two
+// chunks' worth of polygons are held at once. CSV lines with a malformed
+// or out-of-range value are skipped and counted.
+class PolygonReader
+{
+public:
+
+    PolygonReader(int a_threads, size_t a_chunkBytes);
+    virtual ~PolygonReader();
+
+    bool Load(const string& a_path, PolygonFormat a_format, const function<void(vector<Branch>&)>& a_sink, LoadStats* a_stats);
+    bool Load(const string& a_path, PolygonFormat a_format, RTree& a_index, LoadStats* a_stats);
+
+    static bool WriteBinary(const string& a_path, const vector<vector<pair<int, int>>>& a_polygons);
+    static Rect PolygonMBR(const pair<int, int>* a_points, size_t a_count);
+
+
+protected:
+
+    const char* Boundary(const char* a_from, const char* a_target, const char* a_end, PolygonFormat a_format) const;
+    void ParseSlice(const char* a_begin, const char* a_end, PolygonFormat a_format, vector<Branch>& a_out, long long& a_skipped) const;
+    void ParseChunk(const char* a_begin, const char* a_end, PolygonFormat a_format, vector<Branch>& a_out, long long& a_skipped, const char*& a_next) const;
+
+    int m_threads;
+    size_t m_chunkBytes;
+};
+
+#endif
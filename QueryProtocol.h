@@ -0,0 +1,75 @@
+#ifndef QUERYPROTOCOL_H
+#define QUERYPROTOCOL_H
+
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <vector>
+
+using namespace std;
+
+// Wire format shared by server.cpp and loadgen.cpp (host byte order, the
+// socket is local). A client may send any number of requests before reading;
+// responses come back in completion order and are matched by m_id.
+//
+//   request : QueryRequest
+//   response: QueryResponseHeader, then for WINDOW/KNN m_count objects, each
+//             a uint32 vertex count followed by that many (int32 x, int32 y)
+
+enum QueryType
+{
+    QUERY_WINDOW = 1,
+    QUERY_KNN = 2,
+    QUERY_COUNT = 3
+};
+
+struct QueryRequest
+{
+    uint32_t m_id;
+    uint32_t m_type;
+    int32_t m_args[4];   // WINDOW/COUNT: minX minY maxX maxY, KNN: x y k
+};
+
+struct QueryResponseHeader
+{
+    uint32_t m_length;   // bytes that follow this header
+    uint32_t m_id;
+    uint32_t m_count;
+};
+
+
+inline bool ReadFull(int a_fd, void* a_buf, size_t a_len)
+{
+    char* p = (char*)a_buf;
+    while (a_len > 0)
+    {
+        ssize_t n = read(a_fd, p, a_len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        a_len -= n;
+    }
+    return true;
+}
+
+inline bool WriteFull(int a_fd, const void* a_buf, size_t a_len)
+{
+    const char* p = (const char*)a_buf;
+    while (a_len > 0)
+    {
+        ssize_t n = write(a_fd, p, a_len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        a_len -= n;
+    }
+    return true;
+}
+
+inline void AppendRaw(vector<char>& a_out, const void* a_data, size_t a_len)
+{
+    a_out.insert(a_out.end(), (const char*)a_data, (const char*)a_data + a_len);
+}
+
+#endif
@@ -1,15 +1,40 @@
+#include <atomic>
+#include <mutex>
+#include <thread>
+
 #include "RTree.h"
 
 RTree::RTree()
 {
+    m_allocBytes = 0;
+    m_payloadBytes = 0;
+    m_peakBytes = 0;
+    m_trackPeak = false;
+    m_rasterFilter = false;
+    m_reorgThreshold = 0;
+    m_autoReorgBudget = 0;
+    m_reorgCredit = 0;
+    m_tracePath = false;
+    m_pathCache = false;
+    m_pathVersion = 0;
+
     m_root = AllocNode();
     m_root->m_level = 0;
+    m_version = 0;
+
+    m_lazyDelete = false;
+    m_condenseThreshold = 0;
+    m_deadCount = 0;
 }
 
 
 RTree::RTree(const RTree& other) : RTree()
 {
     CopyRec(m_root, other.m_root);
+    m_lazyDelete = other.m_lazyDelete;
+    m_condenseThreshold = other.m_condenseThreshold;
+    m_deadCount = other.m_deadCount;
+    m_repackedDead = other.m_repackedDead;
 }
 
 
@@ -18,14 +43,26 @@ RTree::~RTree()
     Reset();
 }
 
+// Objects removed under lazy deletion are left out, although mObjs keeps
+// them until the next Condense.
 vector<vector<pair<int, int>>> RTree::getObjects() const
 {
-    return mObjs;
+    vector<vector<pair<int, int>>> objects = mObjs;
+    if (m_deadCount > 0)
+    {
+        vector<vector<pair<int, int>>> dead = m_repackedDead;
+        DeadRec(m_root, dead);
+        EraseObjects(objects, dead);
+    }
+    return objects;
 }
 
 void RTree::Insert(const int a_min[2], const int a_max[2], vector<pair<int, int>>& a_dataId)
 {
     mObjs.push_back(a_dataId);
+    TrackPayload(2 * (long long)(a_dataId.size() * sizeof(pair<int, int>)));
+    bool cached = m_pathCache && m_pathVersion == m_version;
+    ++m_version;
 
     Branch branch;
     branch.m_data = a_dataId;
@@ -37,9 +74,166 @@ void RTree::Insert(const int a_min[2], const int a_max[2], vector<pair<int, int>
         branch.m_rect.m_max[axis] = a_max[axis];
     }
 
-    InsertRect(branch, &m_root, 0);
+    if (m_rasterFilter)
+    {
+        BuildRaster(&branch);
+    }
+
+    m_tracePath = m_autoReorgBudget > 0;
+    m_updatePath.clear();
+
+    if (cached && InsertCached(branch))
+    {
+        if (m_tracePath)
+        {
+            m_updatePath = m_insertPath;
+        }
+    }
+    else
+    {
+        InsertRect(branch, &m_root, 0);
+        reverse(m_updatePath.begin(), m_updatePath.end());
+
+        if (m_pathCache)
+        {
+            CachePath(&branch.m_rect);
+        }
+    }
+    if (m_pathCache)
+    {
+        m_pathVersion = m_version;
+    }
+
+    m_tracePath = false;
+    AutoReorganize();
+}
+
+
+// Inserts a run of leaf branches in Hilbert order of their MBR centers with
+// the path cache on, so each insert starts from the lowest node the previous
+// one left that already covers it. (Packing the run into leaves and grafting
+// them in one descent each degenerates this MAXNODES 2 / MINNODES 1 tree:
+// the cascaded 2+1 splits leave chains of one-child nodes and the height
+// runs into the thousands.)
+void RTree::InsertBatch(vector<Branch>& a_branches)
+{
+    SortHilbert(a_branches);
+
+    bool pathCache = m_pathCache;
+    if (!pathCache)
+    {
+        SetPathCache(true);
+    }
+
+    for (unsigned int i = 0; i < a_branches.size(); ++i)
+    {
+        Insert(a_branches[i].m_rect.m_min, a_branches[i].m_rect.m_max, a_branches[i].m_data);
+    }
+
+    if (!pathCache)
+    {
+        SetPathCache(false);
+    }
+}
+
+// For streams where consecutive inserts land close together (objects along
+// a track): Insert keeps the root-to-leaf path it took and starts the next
+// descent from the lowest node on it that already covers the new rectangle.
+// Splits are handled along the cached path; any other change to the tree
+// drops it.
+void RTree::SetPathCache(bool a_enable)
+{
+    m_pathCache = a_enable;
+    m_pathVersion = m_version - 1;
+    m_insertPath.clear();
+}
+
+
+// Inserts below the deepest node of m_insertPath whose MBR contains
+// a_branch, doing what InsertRec would do from there down and walking the
+// cached path back up for splits. Nodes above the starting one need no MBR
+// update, only their object counts. Returns false, leaving the tree
+// untouched, if no cached node contains the rectangle.
+bool RTree::InsertCached(const Branch& a_branch)
+{
+    int depth = (int)m_insertPath.size() - 1;
+    while (depth >= 0 && !Overlap2(&m_insertPath[depth].first->m_branch[m_insertPath[depth].second].m_rect, &a_branch.m_rect))
+    {
+        --depth;
+    }
+    if (depth < 0)
+    {
+        return false;
+    }
+
+    m_insertPath.resize(depth + 1);
+    Node* node = m_insertPath[depth].first->m_branch[m_insertPath[depth].second].m_child;
+    while (node->IsInternalNode())
+    {
+        int index = ChooseLeaf(&a_branch.m_rect, node);
+        m_insertPath.push_back(make_pair(node, index));
+        node = node->m_branch[index].m_child;
+    }
+
+    Node* newNode;
+    bool split = AddBranch(&a_branch, node, &newNode);
+
+    for (int k = (int)m_insertPath.size() - 1; k >= 0; --k)
+    {
+        Node* parent = m_insertPath[k].first;
+        int index = m_insertPath[k].second;
+
+        if (!split)
+        {
+            // From the starting node up only the object counts change.
+            if (k > depth)
+            {
+                parent->m_branch[index].m_rect = CombineRect(&a_branch.m_rect, &parent->m_branch[index].m_rect);
+            }
+            parent->m_branch[index].m_size += BranchSize(&a_branch);
+            continue;
+        }
+
+        parent->m_branch[index].m_rect = NodeCover(parent->m_branch[index].m_child);
+        parent->m_branch[index].m_size = NodeSize(parent->m_branch[index].m_child);
+        Branch branch;
+        branch.m_child = newNode;
+        branch.m_rect = NodeCover(newNode);
+        branch.m_size = NodeSize(newNode);
+
+        Node* otherNode = NULL;
+        split = AddBranch(&branch, parent, &otherNode);
+        newNode = otherNode;
+
+        // A split scrambles the branch indices of the node it splits.
+        if (split)
+        {
+            m_insertPath.resize(k);
+        }
+    }
+
+    if (split)
+    {
+        SplitRoot(&m_root, newNode);
+    }
+    return true;
+}
+
+
+void RTree::CachePath(const Rect* a_rect)
+{
+    m_insertPath.clear();
+
+    Node* node = m_root;
+    while (node->IsInternalNode())
+    {
+        int index = ChooseLeaf(a_rect, node);
+        m_insertPath.push_back(make_pair(node, index));
+        node = node->m_branch[index].m_child;
+    }
 }
 
+
 bool RTree::InsertRec(const Branch& a_branch, Node* a_node, Node** a_newNode, int a_level)
 {
     if (a_node->m_level > a_level)
@@ -50,18 +244,25 @@ bool RTree::InsertRec(const Branch& a_branch, Node* a_node, Node** a_newNode, in
 
 
         bool childWasSplit = InsertRec(a_branch, a_node->m_branch[index].m_child, &otherNode, a_level);
+        if (m_tracePath)
+        {
+            m_updatePath.push_back(make_pair(a_node, index));
+        }
 
         if (!childWasSplit)
         {
             a_node->m_branch[index].m_rect = CombineRect(&a_branch.m_rect, &(a_node->m_branch[index].m_rect));
+            a_node->m_branch[index].m_size += BranchSize(&a_branch);
             return false;
         }
         else
         {
             a_node->m_branch[index].m_rect = NodeCover(a_node->m_branch[index].m_child);
+            a_node->m_branch[index].m_size = NodeSize(a_node->m_branch[index].m_child);
             Branch branch;
             branch.m_child = otherNode;
             branch.m_rect = NodeCover(otherNode);
+            branch.m_size = NodeSize(otherNode);
 
             return AddBranch(&branch, a_node, a_newNode);
         }
@@ -82,30 +283,38 @@ bool RTree::InsertRect(const Branch& a_branch, Node** a_root, int a_level)
 
     if (InsertRec(a_branch, *a_root, &newNode, a_level))
     {
-        Node* newRoot = AllocNode();
-        newRoot->m_level = (*a_root)->m_level + 1;
+        SplitRoot(a_root, newNode);
 
-        Branch branch;
+        return true;
+    }
 
-        branch.m_rect = NodeCover(*a_root);
-        branch.m_child = *a_root;
-        AddBranch(&branch, newRoot, NULL);
+    return false;
+}
 
-        branch.m_rect = NodeCover(newNode);
-        branch.m_child = newNode;
-        AddBranch(&branch, newRoot, NULL);
+void RTree::SplitRoot(Node** a_root, Node* a_newNode)
+{
+    Node* newRoot = AllocNode();
+    newRoot->m_level = (*a_root)->m_level + 1;
 
-        *a_root = newRoot;
+    Branch branch;
 
-        return true;
-    }
+    branch.m_rect = NodeCover(*a_root);
+    branch.m_size = NodeSize(*a_root);
+    branch.m_child = *a_root;
+    AddBranch(&branch, newRoot, NULL);
 
-    return false;
+    branch.m_rect = NodeCover(a_newNode);
+    branch.m_size = NodeSize(a_newNode);
+    branch.m_child = a_newNode;
+    AddBranch(&branch, newRoot, NULL);
+
+    *a_root = newRoot;
 }
 
 
 
-void RTree::Remove(const int a_min[2], const int a_max[2], const vector<pair<int, int>>& a_dataId)
+// Returns true if a matching entry was removed (or marked dead).
+bool RTree::Remove(const int a_min[2], const int a_max[2], const vector<pair<int, int>>& a_dataId)
 {
 
 
@@ -117,670 +326,2990 @@ void RTree::Remove(const int a_min[2], const int a_max[2], const vector<pair<int
         rect.m_max[axis] = a_max[axis];
     }
 
-    RemoveRect(&rect, a_dataId, &m_root);
-}
+    m_tracePath = m_autoReorgBudget > 0;
+    m_updatePath.clear();
 
+    if (m_lazyDelete)
+    {
+        bool found = MarkDeadRec(&rect, a_dataId, m_root);
+        m_tracePath = false;
 
+        if (found)
+        {
+            reverse(m_updatePath.begin(), m_updatePath.end());
+            ++m_version;
+            ++m_deadCount;
+            if (m_deadCount >= m_condenseThreshold)
+            {
+                Condense();
+            }
+            else
+            {
+                AutoReorganize();
+            }
+            return true;
+        }
+        return false;
+    }
 
+    bool notFound = RemoveRect(&rect, a_dataId, &m_root);
+    m_tracePath = false;
 
-int RTree::Count()
-{
-    int count = 0;
-    CountRec(m_root, count);
+    if (notFound)
+    {
+        return false;
+    }
 
-    return count;
-}
+    reverse(m_updatePath.begin(), m_updatePath.end());
+    ++m_version;
 
+    AutoReorganize();
+    return true;
+}
 
 
-void RTree::CountRec(Node* a_node, int& a_count)
+int RTree::RemoveBatch(const vector<Rect>& a_rects, const vector<vector<pair<int, int>>>& a_dataIds)
 {
-    if (a_node->IsInternalNode())
+    int removed = 0;
+
+    for (unsigned int i = 0; i < a_rects.size() && i < a_dataIds.size(); ++i)
     {
-        for (int index = 0; index < a_node->m_count; ++index)
+        if (MarkDeadRec(&a_rects[i], a_dataIds[i], m_root))
         {
-            CountRec(a_node->m_branch[index].m_child, a_count);
+            ++removed;
         }
     }
-    else
+
+    if (removed > 0)
     {
-        a_count += a_node->m_count;
+        ++m_version;
+        m_deadCount += removed;
+        Condense();
     }
+    return removed;
 }
 
 
-void RTree::CopyRec(Node* current, Node* other)
+// With lazy delete on, Remove only marks the entry dead; Search skips dead
+// entries and Condense() runs once a_condenseThreshold of them pile up.
+void RTree::SetLazyDelete(bool a_lazy, int a_condenseThreshold)
 {
-    current->m_level = other->m_level;
-    current->m_count = other->m_count;
+    m_lazyDelete = a_lazy;
+    m_condenseThreshold = Max(a_condenseThreshold, 1);
 
-    if (current->IsInternalNode())
+    if (!m_lazyDelete && m_deadCount > 0)
     {
-        for (int index = 0; index < current->m_count; ++index)
-        {
-            Branch* currentBranch = &current->m_branch[index];
-            Branch* otherBranch = &other->m_branch[index];
+        Condense();
+    }
+}
 
-            std::copy(otherBranch->m_rect.m_min,
-                otherBranch->m_rect.m_min + 2,
-                currentBranch->m_rect.m_min);
 
-            std::copy(otherBranch->m_rect.m_max,
-                otherBranch->m_rect.m_max + 2,
-                currentBranch->m_rect.m_max);
+// Drops every dead entry in a single pass. Underfull nodes are dissolved and
+// their surviving entries reinserted together by BulkReInsert.
+void RTree::Condense()
+{
+    vector<Branch> orphans;
+    vector<vector<pair<int, int>>> removed;
 
-            currentBranch->m_child = AllocNode();
-            CopyRec(currentBranch->m_child, otherBranch->m_child);
-        }
-    }
-    else
+    CondenseRec(m_root, orphans, removed);
+
+    if (m_root->IsInternalNode() && m_root->m_count == 0)
     {
-        for (int index = 0; index < current->m_count; ++index)
-        {
-            Branch* currentBranch = &current->m_branch[index];
-            Branch* otherBranch = &other->m_branch[index];
+        m_root->m_level = 0;
+    }
 
-            std::copy(otherBranch->m_rect.m_min,
-                otherBranch->m_rect.m_min + 2,
-                currentBranch->m_rect.m_min);
+    size_t buffered = BranchBytes(orphans);
+    TrackBytes(buffered);
+    BulkReInsert(orphans);
+    TrackBytes(-(long long)buffered);
 
-            std::copy(otherBranch->m_rect.m_max,
-                otherBranch->m_rect.m_max + 2,
-                currentBranch->m_rect.m_max);
+    while (m_root->IsInternalNode() && m_root->m_count == 1)
+    {
+        Node* tempNode = m_root->m_branch[0].m_child;
+        FreeNode(m_root);
+        m_root = tempNode;
+    }
 
-            currentBranch->m_data = otherBranch->m_data;
-        }
+    for (unsigned int i = 0; i < m_repackedDead.size(); ++i)
+    {
+        removed.push_back(vector<pair<int, int>>());
+        removed.back().swap(m_repackedDead[i]);
     }
+    m_repackedDead.clear();
+
+    ReleaseObjects(removed);
+    m_deadCount = 0;
+    ++m_version;
 }
 
 
-void RTree::RemoveAll()
+bool RTree::CondenseRec(Node* a_node, vector<Branch>& a_orphans, vector<vector<pair<int, int>>>& a_removed)
 {
-    mObjs.clear();
-
-    Reset();
-
-    m_root = AllocNode();
-    m_root->m_level = 0;
-}
+    bool changed = false;
 
+    for (int index = a_node->m_count - 1; index >= 0; --index)
+    {
+        Branch* branch = &a_node->m_branch[index];
 
-void RTree::Reset()
-{
-    RemoveAllRec(m_root);
+        if (a_node->IsLeaf())
+        {
+            if (branch->m_dead)
+            {
+                a_removed.push_back(branch->m_data);
+                DisconnectBranch(a_node, index);
+                changed = true;
+            }
+        }
+        else if (CondenseRec(branch->m_child, a_orphans, a_removed))
+        {
+            changed = true;
+            if (branch->m_child->m_count >= MINNODES)
+            {
+                branch->m_rect = NodeCover(branch->m_child);
+                branch->m_size = NodeSize(branch->m_child);
+            }
+            else
+            {
+                OrphanRec(branch->m_child, a_orphans, a_removed);
+                DisconnectBranch(a_node, index);
+            }
+        }
+    }
+    return changed;
 }
 
 
-void RTree::RemoveAllRec(Node* a_node)
+void RTree::OrphanRec(Node* a_node, vector<Branch>& a_orphans, vector<vector<pair<int, int>>>& a_removed)
 {
-    if (a_node->IsInternalNode())
+    for (int index = 0; index < a_node->m_count; ++index)
     {
-        for (int index = 0; index < a_node->m_count; ++index)
+        Branch* branch = &a_node->m_branch[index];
+
+        if (a_node->IsInternalNode())
         {
-            RemoveAllRec(a_node->m_branch[index].m_child);
+            OrphanRec(branch->m_child, a_orphans, a_removed);
+        }
+        else if (branch->m_dead)
+        {
+            a_removed.push_back(branch->m_data);
+        }
+        else
+        {
+            a_orphans.push_back(*branch);
         }
     }
     FreeNode(a_node);
 }
 
 
-Node* RTree::AllocNode()
-{
-    Node* newNode;
-    newNode = new Node;
-    InitNode(newNode);
-    return newNode;
-}
-
-
-void RTree::FreeNode(Node* a_node)
+// Orphans are sorted along the Hilbert curve and packed into full leaves,
+// which are then hung into the tree at level 1 one leaf at a time.
+void RTree::BulkReInsert(vector<Branch>& a_orphans)
 {
-    delete a_node;
-}
-
+    SortHilbert(a_orphans);
 
-ListNode* RTree::AllocListNode()
-{
-    return new ListNode;
-}
+    unsigned int i = 0;
+    while (i < a_orphans.size())
+    {
+        if (m_root->IsLeaf() || a_orphans.size() - i < MINNODES)
+        {
+            InsertRect(a_orphans[i], &m_root, 0);
+            ++i;
+            continue;
+        }
 
+        Node* leaf = AllocNode();
+        leaf->m_level = 0;
+        for (; i < a_orphans.size() && leaf->m_count < MAXNODES; ++i)
+        {
+            AddBranch(&a_orphans[i], leaf, NULL);
+        }
 
-void RTree::FreeListNode(ListNode* a_listNode)
-{
-    delete a_listNode;
+        Branch branch;
+        branch.m_rect = NodeCover(leaf);
+        branch.m_size = NodeSize(leaf);
+        branch.m_child = leaf;
+        InsertRect(branch, &m_root, 1);
+    }
 }
 
 
-void RTree::InitNode(Node* a_node)
+void RTree::SortHilbert(vector<Branch>& a_branches)
 {
-    a_node->m_count = 0;
-    a_node->m_level = -1;
-}
-
+    vector<pair<unsigned long long, int>> order(a_branches.size());
+    for (unsigned int i = 0; i < a_branches.size(); ++i)
+    {
+        const Rect& rect = a_branches[i].m_rect;
+        order[i].first = HilbertValue((int)(((long long)rect.m_min[0] + rect.m_max[0]) / 2),
+            (int)(((long long)rect.m_min[1] + rect.m_max[1]) / 2));
+        order[i].second = i;
+    }
+    sort(order.begin(), order.end());
 
-void RTree::InitRect(Rect* a_rect)
-{
-    for (int index = 0; index < 2; ++index)
+    vector<Branch> sorted;
+    sorted.reserve(a_branches.size());
+    for (unsigned int i = 0; i < order.size(); ++i)
     {
-        a_rect->m_min[index] = (int)0;
-        a_rect->m_max[index] = (int)0;
+        sorted.push_back(a_branches[order[i].second]);
     }
+    a_branches.swap(sorted);
 }
 
 
-Rect RTree::NodeCover(Node* a_node)
+// Drops one occurrence from a_objects per entry of a_removed, keeping the
+// order of the rest: a_removed is sorted and each object looked up in it
+// once, so a mass deletion costs O((n + r) log r). Returns the vertex bytes
+// dropped.
+size_t RTree::EraseObjects(vector<vector<pair<int, int>>>& a_objects, vector<vector<pair<int, int>>>& a_removed) const
 {
-
-    Rect rect = a_node->m_branch[0].m_rect;
-    for (int index = 1; index < a_node->m_count; ++index)
+    if (a_removed.empty())
     {
-        rect = CombineRect(&rect, &(a_node->m_branch[index].m_rect));
+        return 0;
     }
 
-    return rect;
-}
-
+    sort(a_removed.begin(), a_removed.end());
 
-bool RTree::AddBranch(const Branch* a_branch, Node* a_node, Node** a_newNode)
-{
-    if (a_node->m_count < MAXNODES)
+    // taken[k]: a_removed[k] has already claimed an object.
+    vector<bool> erase(a_objects.size(), false);
+    vector<bool> taken(a_removed.size(), false);
+    for (unsigned int i = 0; i < a_objects.size(); ++i)
     {
-        a_node->m_branch[a_node->m_count] = *a_branch;
-        ++a_node->m_count;
+        auto it = lower_bound(a_removed.begin(), a_removed.end(), a_objects[i]);
+        for (unsigned int k = (unsigned int)(it - a_removed.begin()); k < a_removed.size() && a_removed[k] == a_objects[i]; ++k)
+        {
+            if (!taken[k])
+            {
+                taken[k] = true;
+                erase[i] = true;
+                break;
+            }
+        }
+    }
 
+    size_t bytes = 0;
+    unsigned int kept = 0;
+    for (unsigned int i = 0; i < a_objects.size(); ++i)
+    {
+        if (erase[i])
+        {
+            bytes += a_objects[i].size() * sizeof(pair<int, int>);
+        }
+        else
+        {
+            if (kept != i)
+            {
+                a_objects[kept].swap(a_objects[i]);
+            }
+            ++kept;
+        }
+    }
+    a_objects.resize(kept);
+    return bytes;
+}
+
+
+void RTree::DeadRec(Node* a_node, vector<vector<pair<int, int>>>& a_dead) const
+{
+    for (int index = 0; index < a_node->m_count; ++index)
+    {
+        if (a_node->IsInternalNode())
+        {
+            DeadRec(a_node->m_branch[index].m_child, a_dead);
+        }
+        else if (a_node->m_branch[index].m_dead)
+        {
+            a_dead.push_back(a_node->m_branch[index].m_data);
+        }
+    }
+}
+
+
+bool RTree::MarkDeadRec(const Rect* a_rect, const vector<pair<int, int>>& a_id, Node* a_node)
+{
+    for (int index = 0; index < a_node->m_count; ++index)
+    {
+        Branch* branch = &a_node->m_branch[index];
+
+        if (!Overlap(a_rect, &branch->m_rect))
+        {
+            continue;
+        }
+
+        if (a_node->IsInternalNode())
+        {
+            if (MarkDeadRec(a_rect, a_id, branch->m_child))
+            {
+                --branch->m_size;
+                if (m_tracePath)
+                {
+                    m_updatePath.push_back(make_pair(a_node, index));
+                }
+                return true;
+            }
+        }
+        else if (!branch->m_dead && branch->m_data == a_id)
+        {
+            branch->m_dead = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+
+
+int RTree::Count()
+{
+    int count = 0;
+    CountRec(m_root, count);
+
+    return count;
+}
+
+
+// Cover of everything in the tree; false when the tree is empty. Under lazy
+// deletion the cover may still include dead entries until Condense.
+bool RTree::Bounds(Rect& a_bounds)
+{
+    if (m_root->m_count == 0)
+    {
+        return false;
+    }
+    a_bounds = NodeCover(m_root);
+    return true;
+}
+
+
+
+void RTree::CountRec(Node* a_node, int& a_count)
+{
+    if (a_node->IsInternalNode())
+    {
+        for (int index = 0; index < a_node->m_count; ++index)
+        {
+            CountRec(a_node->m_branch[index].m_child, a_count);
+        }
+    }
+    else
+    {
+        for (int index = 0; index < a_node->m_count; ++index)
+        {
+            if (!a_node->m_branch[index].m_dead)
+            {
+                ++a_count;
+            }
+        }
+    }
+}
+
+
+// Number of live objects a window Search would return, without copying
+// them: a branch lying inside the window adds its object count whole.
+int RTree::Count(const Rect& a_rect)
+{
+    int count = 0;
+    CountRec(m_root, a_rect, count);
+
+    return count;
+}
+
+
+void RTree::CountRec(Node* a_node, const Rect& a_rect, int& a_count)
+{
+    for (int index = 0; index < a_node->m_count; ++index)
+    {
+        Branch* branch = &a_node->m_branch[index];
+        if (!Overlap(&branch->m_rect, &a_rect))
+        {
+            continue;
+        }
+
+        if (a_node->IsLeaf())
+        {
+            a_count += branch->m_dead ? 0 : 1;
+        }
+        else if (Overlap2(&a_rect, &branch->m_rect))
+        {
+            a_count += branch->m_size;
+        }
+        else
+        {
+            CountRec(branch->m_child, a_rect, a_count);
+        }
+    }
+}
+
+
+void RTree::CopyRec(Node* current, Node* other)
+{
+    current->m_level = other->m_level;
+    current->m_count = other->m_count;
+
+    if (current->IsInternalNode())
+    {
+        for (int index = 0; index < current->m_count; ++index)
+        {
+            Branch* currentBranch = &current->m_branch[index];
+            Branch* otherBranch = &other->m_branch[index];
+
+            std::copy(otherBranch->m_rect.m_min,
+                otherBranch->m_rect.m_min + 2,
+                currentBranch->m_rect.m_min);
+
+            std::copy(otherBranch->m_rect.m_max,
+                otherBranch->m_rect.m_max + 2,
+                currentBranch->m_rect.m_max);
+
+            currentBranch->m_size = otherBranch->m_size;
+            currentBranch->m_child = AllocNode();
+            CopyRec(currentBranch->m_child, otherBranch->m_child);
+        }
+    }
+    else
+    {
+        for (int index = 0; index < current->m_count; ++index)
+        {
+            Branch* currentBranch = &current->m_branch[index];
+            Branch* otherBranch = &other->m_branch[index];
+
+            std::copy(otherBranch->m_rect.m_min,
+                otherBranch->m_rect.m_min + 2,
+                currentBranch->m_rect.m_min);
+
+            std::copy(otherBranch->m_rect.m_max,
+                otherBranch->m_rect.m_max + 2,
+                currentBranch->m_rect.m_max);
+
+            currentBranch->m_data = otherBranch->m_data;
+            TrackPayload(currentBranch->m_data.size() * sizeof(pair<int, int>));
+            currentBranch->m_dead = otherBranch->m_dead;
+            currentBranch->m_rasterTouched = otherBranch->m_rasterTouched;
+            currentBranch->m_rasterFull = otherBranch->m_rasterFull;
+        }
+    }
+}
+
+
+void RTree::RemoveAll()
+{
+    mObjs.clear();
+    m_payloadBytes = 0;
+    ++m_version;
+    m_deadCount = 0;
+    m_repackedDead.clear();
+    m_reorgDirty.clear();
+
+    Reset();
+
+    m_root = AllocNode();
+    m_root->m_level = 0;
+}
+
+
+void RTree::Reset()
+{
+    RemoveAllRec(m_root);
+}
+
+
+void RTree::RemoveAllRec(Node* a_node)
+{
+    if (a_node->IsInternalNode())
+    {
+        for (int index = 0; index < a_node->m_count; ++index)
+        {
+            RemoveAllRec(a_node->m_branch[index].m_child);
+        }
+    }
+    FreeNode(a_node);
+}
+
+
+Node* RTree::AllocNode()
+{
+    Node* newNode;
+    newNode = new Node;
+    InitNode(newNode);
+
+    TrackBytes(sizeof(Node));
+    return newNode;
+}
+
+
+void RTree::FreeNode(Node* a_node)
+{
+    TrackBytes(-(long long)sizeof(Node));
+    delete a_node;
+}
+
+
+ListNode* RTree::AllocListNode()
+{
+    TrackBytes(sizeof(ListNode));
+    return new ListNode;
+}
+
+
+void RTree::FreeListNode(ListNode* a_listNode)
+{
+    TrackBytes(-(long long)sizeof(ListNode));
+    delete a_listNode;
+}
+
+
+// m_allocBytes covers nodes, reinsert lists and the branch buffers bulk
+// operations hold; m_payloadBytes the vertex lists of live objects (one copy
+// in a leaf, one in mObjs), counted by size as objects come and go. The
+// peak adds the containers' own arrays at their current capacity.
+void RTree::TrackBytes(long long a_delta)
+{
+    m_allocBytes += a_delta;
+    if (m_trackPeak)
+    {
+        m_peakBytes = Max(m_peakBytes, CurrentBytes());
+    }
+}
+
+
+void RTree::TrackPayload(long long a_delta)
+{
+    m_payloadBytes += a_delta;
+    TrackBytes(0);
+}
+
+
+size_t RTree::CurrentBytes() const
+{
+    return m_allocBytes + m_payloadBytes + mObjs.capacity() * sizeof(vector<pair<int, int>>) +
+        m_insertPath.capacity() * sizeof(pair<Node*, int>);
+}
+
+
+size_t RTree::BranchBytes(const vector<Branch>& a_branches) const
+{
+    size_t bytes = a_branches.capacity() * sizeof(Branch);
+    for (unsigned int i = 0; i < a_branches.size(); ++i)
+    {
+        bytes += a_branches[i].m_data.capacity() * sizeof(pair<int, int>);
+    }
+    return bytes;
+}
+
+
+// Removed objects, whose leaf copies are already gone, leave mObjs and stop
+// counting as payload.
+void RTree::ReleaseObjects(vector<vector<pair<int, int>>>& a_removed)
+{
+    long long bytes = 0;
+    for (unsigned int i = 0; i < a_removed.size(); ++i)
+    {
+        bytes += a_removed[i].size() * sizeof(pair<int, int>);
+    }
+    TrackPayload(-bytes - (long long)EraseObjects(mObjs, a_removed));
+}
+
+
+void RTree::InitNode(Node* a_node)
+{
+    a_node->m_count = 0;
+    a_node->m_level = -1;
+}
+
+
+void RTree::InitRect(Rect* a_rect)
+{
+    for (int index = 0; index < 2; ++index)
+    {
+        a_rect->m_min[index] = (int)0;
+        a_rect->m_max[index] = (int)0;
+    }
+}
+
+
+int RTree::NodeSize(Node* a_node) const
+{
+    int size = 0;
+    for (int index = 0; index < a_node->m_count; ++index)
+    {
+        size += BranchSize(&a_node->m_branch[index]);
+    }
+    return size;
+}
+
+
+int RTree::BranchSize(const Branch* a_branch) const
+{
+    if (a_branch->m_child)
+    {
+        return a_branch->m_size;
+    }
+    return a_branch->m_dead ? 0 : 1;
+}
+
+
+Rect RTree::NodeCover(Node* a_node)
+{
+
+    Rect rect = a_node->m_branch[0].m_rect;
+    for (int index = 1; index < a_node->m_count; ++index)
+    {
+        rect = CombineRect(&rect, &(a_node->m_branch[index].m_rect));
+    }
+
+    return rect;
+}
+
+
+bool RTree::AddBranch(const Branch* a_branch, Node* a_node, Node** a_newNode)
+{
+    if (a_node->m_count < MAXNODES)
+    {
+        a_node->m_branch[a_node->m_count] = *a_branch;
+        ++a_node->m_count;
+
+        return false;
+    }
+    else
+    {
+        SplitNode(a_node, a_branch, a_newNode);
+        return true;
+    }
+}
+
+void RTree::DisconnectBranch(Node* a_node, int a_index)
+{
+    a_node->m_branch[a_index] = a_node->m_branch[a_node->m_count - 1];
+
+    --a_node->m_count;
+}
+
+int RTree::ChooseLeaf(const Rect* a_rect, Node* a_node)
+{
+
+    bool firstTime = true;
+    float increase;
+    float bestIncr = (float)-1;
+    float area;
+    float bestArea;
+    int best = 0;
+    Rect tempRect;
+
+    for (int index = 0; index < a_node->m_count; ++index)
+    {
+        Rect* curRect = &a_node->m_branch[index].m_rect;
+
+        area = CalcRectArea(curRect);
+        tempRect = CombineRect(a_rect, curRect);
+        increase = CalcRectArea(&tempRect) - area;
+        if ((increase < bestIncr) || firstTime)
+        {
+            best = index;
+            bestArea = area;
+            bestIncr = increase;
+            firstTime = false;
+        }
+        else if ((increase == bestIncr) && (area < bestArea))
+        {
+            best = index;
+            bestArea = area;
+            bestIncr = increase;
+        }
+    }
+    return best;
+}
+
+Rect RTree::CombineRect(const Rect* a_rectA, const Rect* a_rectB)
+{
+
+    Rect newRect;
+
+    for (int index = 0; index < 2; ++index)
+    {
+        newRect.m_min[index] = Min(a_rectA->m_min[index], a_rectB->m_min[index]);
+        newRect.m_max[index] = Max(a_rectA->m_max[index], a_rectB->m_max[index]);
+    }
+
+    return newRect;
+}
+
+void RTree::SplitNode(Node* a_node, const Branch* a_branch, Node** a_newNode)
+{
+    PartitionVars localVars;
+    PartitionVars* parVars = &localVars;
+
+    GetBranches(a_node, a_branch, parVars);
+
+    QuadraticSplit(parVars, MINNODES);
+
+    *a_newNode = AllocNode();
+    (*a_newNode)->m_level = a_node->m_level;
+
+    a_node->m_count = 0;
+    LoadNodes(a_node, *a_newNode, parVars);
+
+}
+float RTree::CalcRectArea(const Rect* a_rect)
+{
+    float area;
+
+    area = ((float)a_rect->m_max[0] - (float)a_rect->m_min[0]) * ((float)a_rect->m_max[1] - (float)a_rect->m_min[1]);
+
+  return area;
+}
+
+
+void RTree::GetBranches(Node* a_node, const Branch* a_branch, PartitionVars* a_parVars)
+{
+
+    for (int index = 0; index < MAXNODES; ++index)
+    {
+        a_parVars->m_branchBuf[index] = a_node->m_branch[index];
+    }
+    a_parVars->m_branchBuf[MAXNODES] = *a_branch;
+    a_parVars->m_branchCount = MAXNODES + 1;
+
+    a_parVars->m_coverSplit = a_parVars->m_branchBuf[0].m_rect;
+    for (int index = 1; index < MAXNODES + 1; ++index)
+    {
+        a_parVars->m_coverSplit = CombineRect(&a_parVars->m_coverSplit, &a_parVars->m_branchBuf[index].m_rect);
+    }
+    a_parVars->m_coverSplitArea = CalcRectArea(&a_parVars->m_coverSplit);
+}
+
+
+void RTree::QuadraticSplit(PartitionVars* a_parVars, int a_minFill)
+{
+    float biggestDiff;
+    int group, chosen = 0, betterGroup = 0;
+
+    InitParVars(a_parVars, a_parVars->m_branchCount, a_minFill);
+    PickSeeds(a_parVars);
+
+    while (((a_parVars->m_count[0] + a_parVars->m_count[1]) < a_parVars->m_total)
+        && (a_parVars->m_count[0] < (a_parVars->m_total - a_parVars->m_minFill))
+        && (a_parVars->m_count[1] < (a_parVars->m_total - a_parVars->m_minFill)))
+    {
+        biggestDiff = (float)-1;
+        for (int index = 0; index<a_parVars->m_total; ++index)
+        {
+            if (PartitionVars::NOT_TAKEN == a_parVars->m_partition[index])
+            {
+                Rect* curRect = &a_parVars->m_branchBuf[index].m_rect;
+                Rect rect0 = CombineRect(curRect, &a_parVars->m_cover[0]);
+                Rect rect1 = CombineRect(curRect, &a_parVars->m_cover[1]);
+                float growth0 = CalcRectArea(&rect0) - a_parVars->m_area[0];
+                float growth1 = CalcRectArea(&rect1) - a_parVars->m_area[1];
+                float diff = growth1 - growth0;
+                if (diff >= 0)
+                {
+                    group = 0;
+                }
+                else
+                {
+                    group = 1;
+                    diff = -diff;
+                }
+
+                if (diff > biggestDiff)
+                {
+                    biggestDiff = diff;
+                    chosen = index;
+                    betterGroup = group;
+                }
+                else if ((diff == biggestDiff) && (a_parVars->m_count[group] < a_parVars->m_count[betterGroup]))
+                {
+                    chosen = index;
+                    betterGroup = group;
+                }
+            }
+        }
+        Classify(chosen, betterGroup, a_parVars);
+    }
+
+    if ((a_parVars->m_count[0] + a_parVars->m_count[1]) < a_parVars->m_total)
+    {
+        if (a_parVars->m_count[0] >= a_parVars->m_total - a_parVars->m_minFill)
+        {
+            group = 1;
+        }
+        else
+        {
+            group = 0;
+        }
+        for (int index = 0; index<a_parVars->m_total; ++index)
+        {
+            if (PartitionVars::NOT_TAKEN == a_parVars->m_partition[index])
+            {
+                Classify(index, group, a_parVars);
+            }
+        }
+    }
+}
+
+
+void RTree::LoadNodes(Node* a_nodeA, Node* a_nodeB, PartitionVars* a_parVars)
+{
+
+
+    for (int index = 0; index < a_parVars->m_total; ++index)
+    {
+
+        int targetNodeIndex = a_parVars->m_partition[index];
+        Node* targetNodes[] = { a_nodeA, a_nodeB };
+
+        bool nodeWasSplit = AddBranch(&a_parVars->m_branchBuf[index], targetNodes[targetNodeIndex], NULL);
+    }
+}
+
+void RTree::InitParVars(PartitionVars* a_parVars, int a_maxRects, int a_minFill)
+{
+    a_parVars->m_count[0] = a_parVars->m_count[1] = 0;
+    a_parVars->m_area[0] = a_parVars->m_area[1] = (float)0;
+    a_parVars->m_total = a_maxRects;
+    a_parVars->m_minFill = a_minFill;
+    for (int index = 0; index < a_maxRects; ++index)
+    {
+        a_parVars->m_partition[index] = PartitionVars::NOT_TAKEN;
+    }
+}
+
+
+void RTree::PickSeeds(PartitionVars* a_parVars)
+{
+    int seed0 = 0, seed1 = 0;
+    float worst, waste;
+    float area[MAXNODES + 1];
+
+    for (int index = 0; index<a_parVars->m_total; ++index)
+    {
+        area[index] = CalcRectArea(&a_parVars->m_branchBuf[index].m_rect);
+    }
+
+    worst = -a_parVars->m_coverSplitArea - 1;
+    for (int indexA = 0; indexA < a_parVars->m_total - 1; ++indexA)
+    {
+        for (int indexB = indexA + 1; indexB < a_parVars->m_total; ++indexB)
+        {
+            Rect oneRect = CombineRect(&a_parVars->m_branchBuf[indexA].m_rect, &a_parVars->m_branchBuf[indexB].m_rect);
+            waste = CalcRectArea(&oneRect) - area[indexA] - area[indexB];
+            if (waste > worst)
+            {
+                worst = waste;
+                seed0 = indexA;
+                seed1 = indexB;
+            }
+        }
+    }
+
+    Classify(seed0, 0, a_parVars);
+    Classify(seed1, 1, a_parVars);
+}
+
+
+void RTree::Classify(int a_index, int a_group, PartitionVars* a_parVars)
+{
+    a_parVars->m_partition[a_index] = a_group;
+
+    if (a_parVars->m_count[a_group] == 0)
+    {
+        a_parVars->m_cover[a_group] = a_parVars->m_branchBuf[a_index].m_rect;
+    }
+    else
+    {
+        a_parVars->m_cover[a_group] = CombineRect(&a_parVars->m_branchBuf[a_index].m_rect, &a_parVars->m_cover[a_group]);
+    }
+
+    a_parVars->m_area[a_group] = CalcRectArea(&a_parVars->m_cover[a_group]);
+
+    ++a_parVars->m_count[a_group];
+}
+
+bool RTree::RemoveRect(Rect* a_rect, const vector<pair<int, int>>& a_id, Node** a_root)
+{
+    ListNode* reInsertList = NULL;
+
+    if (!DeleteRec(a_rect, a_id, *a_root, &reInsertList))
+    {
+        // The reinserts below are not part of the traced path.
+        bool trace = m_tracePath;
+        m_tracePath = false;
+
+        while (reInsertList)
+        {
+            Node* tempNode = reInsertList->m_node;
+
+            for (int index = 0; index < tempNode->m_count; ++index)
+            {
+                InsertRect(tempNode->m_branch[index],
+                    a_root,
+                    tempNode->m_level);
+            }
+
+            ListNode* remLNode = reInsertList;
+            reInsertList = reInsertList->m_next;
+
+            FreeNode(remLNode->m_node);
+            FreeListNode(remLNode);
+        }
+
+        if ((*a_root)->m_count == 1 && (*a_root)->IsInternalNode())
+        {
+            Node* tempNode = (*a_root)->m_branch[0].m_child;
+
+            FreeNode(*a_root);
+            *a_root = tempNode;
+        }
+        m_tracePath = trace;
+        return false;
+    }
+    else
+    {
+        return true;
+    }
+}
+
+bool RTree::DeleteRec(Rect* a_rect, const vector<pair<int, int>>& a_id, Node* a_node, ListNode** a_listNode)
+{
+
+    if (a_node->IsInternalNode())
+    {
+        for (int index = 0; index < a_node->m_count; ++index)
+        {
+            if (Overlap(a_rect, &(a_node->m_branch[index].m_rect)))
+            {
+                if (!DeleteRec(a_rect, a_id, a_node->m_branch[index].m_child, a_listNode))
+                {
+                    if (m_tracePath)
+                    {
+                        m_updatePath.push_back(make_pair(a_node, index));
+                    }
+                    if (a_node->m_branch[index].m_child->m_count >= MINNODES)
+                    {
+
+                        a_node->m_branch[index].m_rect = NodeCover(a_node->m_branch[index].m_child);
+                        a_node->m_branch[index].m_size = NodeSize(a_node->m_branch[index].m_child);
+                    }
+                    else
+                    {
+
+                        ReInsert(a_node->m_branch[index].m_child, a_listNode);
+                        DisconnectBranch(a_node, index);
+                    }
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+    else
+    {
+        for (int index = 0; index < a_node->m_count; ++index)
+        {
+            if (!a_node->m_branch[index].m_dead && a_node->m_branch[index].m_data == a_id)
+            {
+                long long bytes = a_id.size() * sizeof(pair<int, int>);
+                TrackPayload(-bytes);
+                for(auto it = mObjs.begin(); it != mObjs.end(); ++it) {
+                    if (*it == a_id) {
+                        mObjs.erase(it);
+                        TrackPayload(-bytes);
+                        break;
+                    }
+                }
+                DisconnectBranch(a_node, index);
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+
+bool RTree::Overlap(const Rect* a_rectA, const Rect* a_rectB)
+{
+    for (int index = 0; index < 2; ++index)
+    {
+        if (a_rectA->m_min[index] > a_rectB->m_max[index] ||
+            a_rectB->m_min[index] > a_rectA->m_max[index])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool RTree::Overlap2(const Rect* a_rectA, const Rect* a_rectB) const
+{
+
+    if (a_rectA->m_min[0] <= a_rectB->m_min[0] &&
+        a_rectB->m_max[0] <= a_rectA->m_max[0] &&
+        a_rectA->m_min[1] <= a_rectB->m_min[1] &&
+        a_rectB->m_max[1] <= a_rectA->m_max[1]){
+        return true;
+    } else {
+        return false;
+    }
+}
+
+bool RTree::Equal(const Rect* a_rectA, const Rect* a_rectB) const
+{
+    for (int index = 0; index < 2; ++index)
+    {
+        if (a_rectA->m_min[index] != a_rectB->m_min[index] ||
+            a_rectA->m_max[index] != a_rectB->m_max[index])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void RTree::ReInsert(Node* a_node, ListNode** a_listNode)
+{
+    ListNode* newListNode;
+
+    newListNode = AllocListNode();
+    newListNode->m_node = a_node;
+    newListNode->m_next = *a_listNode;
+    *a_listNode = newListNode;
+}
+
+
+bool RTree::Search(const Rect& a_rect, vector<vector<pair<int, int>>>& a_results)
+{
+    return Search(a_rect, a_results, SEARCH_INTERSECTS);
+}
+
+
+bool RTree::Search(const Rect& a_rect, vector<vector<pair<int, int>>>& a_results, SearchMode a_mode)
+{
+    a_results.clear();
+    SearchRec(m_root, a_rect, a_results, a_mode);
+    return !a_results.empty();
+}
+
+
+SearchCursor RTree::SearchBegin(const Rect& a_rect)
+{
+    return SearchCursor(*this, a_rect);
+}
+
+
+// CONTAINS: objects whose MBR contains the window.
+// WITHIN:   objects whose MBR lies inside the window.
+// EQUALS:   objects whose MBR is exactly the window.
+// Only a node that contains the window can hold a CONTAINS/EQUALS hit, and a
+// node lying inside the window is a WITHIN hit in its entirety.
+void RTree::SearchRec(Node* a_node, const Rect& a_rect, vector<vector<pair<int, int>>>& a_results, SearchMode a_mode)
+{
+
+    if (a_node->IsInternalNode())
+    {
+        for (int index = 0; index < a_node->m_count; ++index)
+        {
+            Rect* rect = &a_node->m_branch[index].m_rect;
+            Node* child = a_node->m_branch[index].m_child;
+
+            switch (a_mode)
+            {
+            case SEARCH_CONTAINS:
+            case SEARCH_EQUALS:
+                if (Overlap2(rect, &a_rect))
+                {
+                    SearchRec(child, a_rect, a_results, a_mode);
+                }
+                break;
+            case SEARCH_WITHIN:
+                if (Overlap2(&a_rect, rect))
+                {
+                    ReportRec(child, a_results);
+                }
+                else if (Overlap(rect, &a_rect))
+                {
+                    SearchRec(child, a_rect, a_results, a_mode);
+                }
+                break;
+            default:
+                if (Overlap(rect, &a_rect))
+                {
+                    SearchRec(child, a_rect, a_results, a_mode);
+                }
+                break;
+            }
+        }
+    }
+    else
+    {
+        for (int index = 0; index < a_node->m_count; ++index)
+        {
+            Rect* rect = &a_node->m_branch[index].m_rect;
+            bool hit;
+
+            if (a_node->m_branch[index].m_dead)
+            {
+                continue;
+            }
+
+            switch (a_mode)
+            {
+            case SEARCH_CONTAINS: hit = Overlap2(rect, &a_rect); break;
+            case SEARCH_WITHIN:   hit = Overlap2(&a_rect, rect); break;
+            case SEARCH_EQUALS:   hit = Equal(rect, &a_rect); break;
+            default:              hit = Overlap(rect, &a_rect); break;
+            }
+
+            if (hit)
+            {
+                a_results.push_back(a_node->m_branch[index].m_data);
+            }
+        }
+    }
+}
+
+
+// Best-first: nodes and leaf entries share one queue ordered by the squared
+// MINDIST of their MBR to the point, so entries pop in distance order.
+bool RTree::Nearest(int a_x, int a_y, int a_k, vector<vector<pair<int, int>>>& a_results)
+{
+    typedef pair<double, pair<Node*, int>> QueueItem;
+    priority_queue<QueueItem, vector<QueueItem>, greater<QueueItem>> queue;
+
+    a_results.clear();
+    queue.push(make_pair(0.0, make_pair(m_root, -1)));
+
+    while (!queue.empty() && (int)a_results.size() < a_k)
+    {
+        Node* node = queue.top().second.first;
+        int entry = queue.top().second.second;
+        queue.pop();
+
+        if (entry >= 0)
+        {
+            a_results.push_back(node->m_branch[entry].m_data);
+            continue;
+        }
+
+        for (int index = 0; index < node->m_count; ++index)
+        {
+            Branch* branch = &node->m_branch[index];
+            double dist = MinDist(&branch->m_rect, a_x, a_y);
+
+            if (node->IsInternalNode())
+            {
+                queue.push(make_pair(dist, make_pair(branch->m_child, -1)));
+            }
+            else if (!branch->m_dead)
+            {
+                queue.push(make_pair(dist, make_pair(node, index)));
+            }
+        }
+    }
+    return !a_results.empty();
+}
+
+
+double RTree::MinDist(const Rect* a_rect, int a_x, int a_y) const
+{
+    double dx = 0, dy = 0;
+
+    if (a_x < a_rect->m_min[0]) dx = (double)a_rect->m_min[0] - a_x;
+    else if (a_x > a_rect->m_max[0]) dx = (double)a_x - a_rect->m_max[0];
+
+    if (a_y < a_rect->m_min[1]) dy = (double)a_rect->m_min[1] - a_y;
+    else if (a_y > a_rect->m_max[1]) dy = (double)a_y - a_rect->m_max[1];
+
+    return dx * dx + dy * dy;
+}
+
+
+void RTree::ReportRec(Node* a_node, vector<vector<pair<int, int>>>& a_results)
+{
+    if (a_node->IsInternalNode())
+    {
+        for (int index = 0; index < a_node->m_count; ++index)
+        {
+            ReportRec(a_node->m_branch[index].m_child, a_results);
+        }
+    }
+    else
+    {
+        for (int index = 0; index < a_node->m_count; ++index)
+        {
+            if (!a_node->m_branch[index].m_dead)
+            {
+                a_results.push_back(a_node->m_branch[index].m_data);
+            }
+        }
+    }
+}
+
+
+bool RTree::getMBRs(vector<vector<vector<pair<int, int>>>>& mbrs_n)
+{
+    vector<Branch> current_level_branches, next_level_branches;
+    mbrs_n.clear();
+    vector<vector<pair<int, int>>> current_mbrs;
+
+    if (m_root->m_count == 0) return true;
+
+    for (int i = 0; i < m_root->m_count; i++) {
+        current_level_branches.push_back(m_root->m_branch[i]);
+    }
+
+    int current_level = m_root->m_level;
+
+    while (!current_level_branches.empty()) {
+        current_mbrs.clear();
+        next_level_branches.clear();
+
+        for (unsigned int i = 0; i < current_level_branches.size(); i++) {
+            Branch& b = current_level_branches[i];
+
+            vector<pair<int, int>> q;
+            pair<int, int> p;
+
+            p.first = b.m_rect.m_min[0];
+            p.second = b.m_rect.m_min[1];
+            q.push_back(p);
+
+            p.first = b.m_rect.m_max[0];
+            p.second = b.m_rect.m_max[1];
+            q.push_back(p);
+            current_mbrs.push_back(q);
+
+            if (current_level > 0 && b.m_child != NULL) {
+                if (b.m_child->m_level == current_level - 1) {
+                    for (int j = 0; j < b.m_child->m_count; j++) {
+                        next_level_branches.push_back(b.m_child->m_branch[j]);
+                    }
+                }
+            }
+        }
+
+        mbrs_n.push_back(current_mbrs);
+
+        current_level_branches = next_level_branches;
+        current_level--;
+    }
+    return true;
+}
+
+
+void RTree::getLeafBranches(vector<Branch>& a_branches)
+{
+    a_branches.clear();
+    LeafBranchesRec(m_root, a_branches);
+}
+
+
+void RTree::LeafBranchesRec(Node* a_node, vector<Branch>& a_branches)
+{
+    for (int index = 0; index < a_node->m_count; ++index)
+    {
+        if (a_node->IsInternalNode())
+        {
+            LeafBranchesRec(a_node->m_branch[index].m_child, a_branches);
+        }
+        else if (!a_node->m_branch[index].m_dead)
+        {
+            a_branches.push_back(a_node->m_branch[index]);
+        }
+    }
+}
+
+
+Rect RTree::MBR(vector<pair<int, int>> pol)
+{
+    int x1 = pol[0].first;
+    int x2 = pol[0].first;
+    int y1 = pol[0].second;
+    int y2 = pol[0].second;
+    if (pol.size() == 1) {
+        x1 -= 5; x2 += 5; y1 -= 5; y2 += 5;
+    }
+    else {
+        for (unsigned int i = 1; i < pol.size(); i++) {
+            if (pol[i].first < x1) {
+                x1 = pol[i].first;
+            }
+            if (x2 < pol[i].first) {
+                x2 = pol[i].first;
+            }
+            if (pol[i].second < y1) {
+                y1 = pol[i].second;
+            }
+            if (y2 < pol[i].second) {
+                y2 = pol[i].second;
+            }
+        }
+    }
+
+    return Rect(x1, y1, x2, y2);
+}
+
+
+SearchCursor::SearchCursor(RTree& a_tree, const Rect& a_rect)
+{
+    m_tree = &a_tree;
+    m_rect = a_rect;
+    m_version = a_tree.m_version;
+    m_stack.push_back(make_pair(a_tree.m_root, 0));
+}
+
+
+SearchCursor::Status SearchCursor::Next(int a_max, vector<vector<pair<int, int>>>& a_results)
+{
+    a_results.clear();
+
+    if (m_version != m_tree->m_version)
+    {
+        return STALE;
+    }
+
+    while (!m_stack.empty() && (int)a_results.size() < a_max)
+    {
+        Node* node = m_stack.back().first;
+        int index = m_stack.back().second;
+
+        if (index >= node->m_count)
+        {
+            m_stack.pop_back();
+            continue;
+        }
+        ++m_stack.back().second;
+
+        Branch* branch = &node->m_branch[index];
+        if (!m_tree->Overlap(&branch->m_rect, &m_rect))
+        {
+            continue;
+        }
+
+        if (node->IsInternalNode())
+        {
+            m_stack.push_back(make_pair(branch->m_child, 0));
+        }
+        else if (!branch->m_dead)
+        {
+            a_results.push_back(branch->m_data);
+        }
+    }
+
+    return m_stack.empty() ? DONE : MORE;
+}
+
+
+unsigned long long RTree::HilbertValue(int a_x, int a_y)
+{
+    unsigned long long x = (unsigned int)a_x ^ 0x80000000u;
+    unsigned long long y = (unsigned int)a_y ^ 0x80000000u;
+    unsigned long long d = 0;
+
+    for (unsigned long long s = 1ull << 31; s > 0; s >>= 1)
+    {
+        unsigned long long rx = (x & s) ? 1 : 0;
+        unsigned long long ry = (y & s) ? 1 : 0;
+        d += s * s * ((3 * rx) ^ ry);
+
+        if (ry == 0)
+        {
+            if (rx == 1)
+            {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            swap(x, y);
+        }
+    }
+    return d;
+}
+
+
+size_t MemoryStats::Total() const
+{
+    size_t total = m_leafPayloadBytes + m_objectStoreBytes + m_pathCacheBytes;
+    for (unsigned int i = 0; i < m_nodeBytes.size(); ++i)
+    {
+        total += m_nodeBytes[i];
+    }
+    return total;
+}
+
+
+// m_nodeBytes[level] counts whole Node structs (raster masks included), so
+// m_unusedSlotBytes (empty m_branch slots) is a part of it. Payload and
+// object store are the heap capacity behind the polygon vectors, and
+// m_slackBytes the part of that capacity (and of mObjs's own array) past
+// the elements in use. m_peakBytes is the high-water mark of the running
+// estimate kept by TrackBytes since TrackPeakMemory(true), or that estimate
+// now when tracking is off; it counts payload by size, so it sits a little
+// under Total() when vectors carry slack.
+MemoryStats RTree::MemoryUsage()
+{
+    MemoryStats stats;
+    stats.m_nodeBytes.assign(m_root->m_level + 1, 0);
+    stats.m_leafPayloadBytes = 0;
+    stats.m_unusedSlotBytes = 0;
+    stats.m_slackBytes = 0;
+    stats.m_pathCacheBytes = m_insertPath.capacity() * sizeof(pair<Node*, int>);
+    stats.m_peakBytes = m_trackPeak ? m_peakBytes : CurrentBytes();
+
+    MemoryRec(m_root, stats);
+    for (unsigned int i = 0; i < m_repackedDead.size(); ++i)
+    {
+        stats.m_leafPayloadBytes += m_repackedDead[i].capacity() * sizeof(pair<int, int>);
+    }
+
+    stats.m_objectStoreBytes = mObjs.capacity() * sizeof(vector<pair<int, int>>);
+    stats.m_slackBytes += (mObjs.capacity() - mObjs.size()) * sizeof(vector<pair<int, int>>);
+    for (unsigned int i = 0; i < mObjs.size(); ++i)
+    {
+        stats.m_objectStoreBytes += mObjs[i].capacity() * sizeof(pair<int, int>);
+        stats.m_slackBytes += (mObjs[i].capacity() - mObjs[i].size()) * sizeof(pair<int, int>);
+    }
+    return stats;
+}
+
+
+void RTree::MemoryRec(Node* a_node, MemoryStats& a_stats)
+{
+    a_stats.m_nodeBytes[a_node->m_level] += sizeof(Node);
+    a_stats.m_unusedSlotBytes += (MAXNODES + 1 - a_node->m_count) * sizeof(Branch);
+
+    for (int index = 0; index < a_node->m_count; ++index)
+    {
+        if (a_node->IsInternalNode())
+        {
+            MemoryRec(a_node->m_branch[index].m_child, a_stats);
+        }
+        else
+        {
+            const vector<pair<int, int>>& data = a_node->m_branch[index].m_data;
+            a_stats.m_leafPayloadBytes += data.capacity() * sizeof(pair<int, int>);
+            a_stats.m_slackBytes += (data.capacity() - data.size()) * sizeof(pair<int, int>);
+        }
+    }
+}
+
+
+void RTree::TrackPeakMemory(bool a_enable)
+{
+    m_trackPeak = a_enable;
+    m_peakBytes = CurrentBytes();
+}
+
+
+// When enabled, Insert attaches an 8x8 raster over the object's MBR: one bit
+// per cell the geometry touches and one per cell lying wholly inside it.
+void RTree::SetRasterFilter(bool a_enable)
+{
+    m_rasterFilter = a_enable;
+}
+
+
+// Window query on the actual geometry. MBR candidates go through the raster
+// first (no touched cell in the window: reject, a full cell in the window:
+// accept) and only the undecided ones get the exact test.
+bool RTree::SearchExact(const Rect& a_rect, vector<vector<pair<int, int>>>& a_results, FilterStats* a_stats)
+{
+    FilterStats stats;
+    stats.m_candidates = 0;
+    stats.m_rasterRejected = 0;
+    stats.m_rasterAccepted = 0;
+    stats.m_exactTested = 0;
+    stats.m_exactRejected = 0;
+
+    a_results.clear();
+    SearchExactRec(m_root, a_rect, a_results, stats);
+
+    if (a_stats)
+    {
+        *a_stats = stats;
+    }
+    return !a_results.empty();
+}
+
+
+void RTree::SearchExactRec(Node* a_node, const Rect& a_rect, vector<vector<pair<int, int>>>& a_results, FilterStats& a_stats)
+{
+    for (int index = 0; index < a_node->m_count; ++index)
+    {
+        Branch* branch = &a_node->m_branch[index];
+
+        if (!Overlap(&branch->m_rect, &a_rect))
+        {
+            continue;
+        }
+        if (a_node->IsInternalNode())
+        {
+            SearchExactRec(branch->m_child, a_rect, a_results, a_stats);
+            continue;
+        }
+        if (branch->m_dead)
+        {
+            continue;
+        }
+
+        ++a_stats.m_candidates;
+
+        int raster = RasterTest(branch, &a_rect);
+        if (raster < 0)
+        {
+            ++a_stats.m_rasterRejected;
+        }
+        else if (raster > 0)
+        {
+            ++a_stats.m_rasterAccepted;
+            a_results.push_back(branch->m_data);
+        }
+        else
+        {
+            ++a_stats.m_exactTested;
+            if (GeometryIntersects(branch->m_data, &a_rect))
+            {
+                a_results.push_back(branch->m_data);
+            }
+            else
+            {
+                ++a_stats.m_exactRejected;
+            }
+        }
+    }
+}
+
+
+Rect RTree::RasterCell(const Rect* a_mbr, int a_col, int a_row) const
+{
+    long long width = (long long)a_mbr->m_max[0] - a_mbr->m_min[0];
+    long long height = (long long)a_mbr->m_max[1] - a_mbr->m_min[1];
+
+    return Rect((int)(a_mbr->m_min[0] + width * a_col / 8),
+        (int)(a_mbr->m_min[1] + height * a_row / 8),
+        (int)(a_mbr->m_min[0] + width * (a_col + 1) / 8),
+        (int)(a_mbr->m_min[1] + height * (a_row + 1) / 8));
+}
+
+
+void RTree::BuildRaster(Branch* a_branch) const
+{
+    const vector<pair<int, int>>& pol = a_branch->m_data;
+
+    a_branch->m_rasterTouched = 0;
+    a_branch->m_rasterFull = 0;
+
+    for (int row = 0; row < 8; ++row)
+    {
+        for (int col = 0; col < 8; ++col)
+        {
+            Rect cell = RasterCell(&a_branch->m_rect, col, row);
+            unsigned long long bit = 1ull << (row * 8 + col);
+
+            if (!GeometryIntersects(pol, &cell))
+            {
+                continue;
+            }
+            a_branch->m_rasterTouched |= bit;
+
+            if (pol.size() < 3)
+            {
+                continue;
+            }
+
+            bool crossed = false;
+            for (unsigned int i = 0; i < pol.size() && !crossed; ++i)
+            {
+                crossed = SegmentIntersectsRect(pol[i], pol[(i + 1) % pol.size()], &cell);
+            }
+            if (!crossed)
+            {
+                a_branch->m_rasterFull |= bit;
+            }
+        }
+    }
+}
+
+
+// Bits of the raster columns (or rows) along one axis of [a_min, a_max]
+// that [a_low, a_high] overlaps. Cell k spans [a_min + w*k/8, a_min +
+// w*(k+1)/8] as in RasterCell, so the first and last cells hit follow from
+// one division each.
+unsigned int RTree::RasterSpan(int a_min, int a_max, int a_low, int a_high) const
+{
+    long long width = (long long)a_max - a_min;
+    long long low = (long long)a_low - a_min;
+    long long high = (long long)a_high - a_min;
+
+    if (high < 0 || low > width)
+    {
+        return 0;
+    }
+    if (width == 0)
+    {
+        return 0xff;
+    }
+
+    // Cell k ends at or after low iff w*(k+1) >= 8*low; it starts at or
+    // before high iff w*k < 8*(high+1).
+    int first = low <= 0 ? 0 : (int)((8 * low + width - 1) / width) - 1;
+    int last = Min(7, (int)((8 * (high + 1) + width - 1) / width) - 1);
+    return (0xffu >> (7 - last)) & (0xffu << first);
+}
+
+
+// 1: certainly intersects, -1: certainly not, 0: needs the exact test.
+int RTree::RasterTest(const Branch* a_branch, const Rect* a_rect) const
+{
+    if (a_branch->m_rasterTouched == 0)
+    {
+        return 0;
+    }
+
+    unsigned int cols = RasterSpan(a_branch->m_rect.m_min[0], a_branch->m_rect.m_max[0], a_rect->m_min[0], a_rect->m_max[0]);
+    unsigned int rows = RasterSpan(a_branch->m_rect.m_min[1], a_branch->m_rect.m_max[1], a_rect->m_min[1], a_rect->m_max[1]);
+
+    unsigned long long window = 0;
+    for (int row = 0; row < 8; ++row)
+    {
+        if (rows & (1u << row))
+        {
+            window |= (unsigned long long)cols << (row * 8);
+        }
+    }
+
+    if (window & a_branch->m_rasterFull)
+    {
+        return 1;
+    }
+    return (window & a_branch->m_rasterTouched) ? 0 : -1;
+}
+
+
+// One vertex is a point, two a segment, three or more a closed polygon.
+bool RTree::GeometryIntersects(const vector<pair<int, int>>& a_pol, const Rect* a_rect) const
+{
+    for (unsigned int i = 0; i < a_pol.size(); ++i)
+    {
+        if (a_rect->m_min[0] <= a_pol[i].first && a_pol[i].first <= a_rect->m_max[0] &&
+            a_rect->m_min[1] <= a_pol[i].second && a_pol[i].second <= a_rect->m_max[1])
+        {
+            return true;
+        }
+    }
+
+    if (a_pol.size() < 2)
+    {
         return false;
     }
-    else
+
+    unsigned int edges = a_pol.size() == 2 ? 1 : a_pol.size();
+    for (unsigned int i = 0; i < edges; ++i)
     {
-        SplitNode(a_node, a_branch, a_newNode);
+        if (SegmentIntersectsRect(a_pol[i], a_pol[(i + 1) % a_pol.size()], a_rect))
+        {
+            return true;
+        }
+    }
+
+    return a_pol.size() >= 3 &&
+        PointInPolygon(a_pol, ((double)a_rect->m_min[0] + a_rect->m_max[0]) / 2, ((double)a_rect->m_min[1] + a_rect->m_max[1]) / 2);
+}
+
+
+bool RTree::PointInPolygon(const vector<pair<int, int>>& a_pol, double a_x, double a_y) const
+{
+    bool inside = false;
+
+    for (unsigned int i = 0, j = a_pol.size() - 1; i < a_pol.size(); j = i++)
+    {
+        double xi = a_pol[i].first, yi = a_pol[i].second;
+        double xj = a_pol[j].first, yj = a_pol[j].second;
+
+        if (((yi > a_y) != (yj > a_y)) && (a_x < (xj - xi) * (a_y - yi) / (yj - yi) + xi))
+        {
+            inside = !inside;
+        }
+    }
+    return inside;
+}
+
+
+// Liang-Barsky clip of the segment against the closed rectangle.
+bool RTree::SegmentIntersectsRect(pair<int, int> a_p0, pair<int, int> a_p1, const Rect* a_rect) const
+{
+    double t0 = 0, t1 = 1;
+    double d[2] = { (double)a_p1.first - a_p0.first, (double)a_p1.second - a_p0.second };
+    double p[2] = { (double)a_p0.first, (double)a_p0.second };
+
+    for (int axis = 0; axis < 2; ++axis)
+    {
+        if (d[axis] == 0)
+        {
+            if (p[axis] < a_rect->m_min[axis] || p[axis] > a_rect->m_max[axis])
+            {
+                return false;
+            }
+            continue;
+        }
+
+        double ta = (a_rect->m_min[axis] - p[axis]) / d[axis];
+        double tb = (a_rect->m_max[axis] - p[axis]) / d[axis];
+        if (ta > tb)
+        {
+            swap(ta, tb);
+        }
+        t0 = Max(t0, ta);
+        t1 = Min(t1, tb);
+        if (t0 > t1)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+bool RTree::SegmentQuery(pair<int, int> a_p0, pair<int, int> a_p1, vector<vector<pair<int, int>>>& a_results, bool a_exact)
+{
+    pair<double, double> dir((double)a_p1.first - a_p0.first, (double)a_p1.second - a_p0.second);
+    return RayQuery(a_p0, dir, 1.0, numeric_limits<int>::max(), a_results, a_exact);
+}
+
+
+// Objects hit by origin + t * dir, 0 <= t <= a_maxT, nearest first. Nodes and
+// entries are queued by the t at which the ray enters their MBR (or, with
+// a_exact, the geometry itself), so the query can stop after a_maxHits.
+bool RTree::RayQuery(pair<int, int> a_origin, pair<double, double> a_dir, double a_maxT, int a_maxHits, vector<vector<pair<int, int>>>& a_results, bool a_exact)
+{
+    typedef pair<double, pair<Node*, int>> QueueItem;
+    priority_queue<QueueItem, vector<QueueItem>, greater<QueueItem>> queue;
+
+    double origin[2] = { (double)a_origin.first, (double)a_origin.second };
+    double dir[2] = { a_dir.first, a_dir.second };
+    double t;
+
+    a_results.clear();
+    queue.push(make_pair(0.0, make_pair(m_root, -1)));
+
+    while (!queue.empty() && (int)a_results.size() < a_maxHits)
+    {
+        Node* node = queue.top().second.first;
+        int entry = queue.top().second.second;
+        queue.pop();
+
+        if (entry >= 0)
+        {
+            a_results.push_back(node->m_branch[entry].m_data);
+            continue;
+        }
+
+        for (int index = 0; index < node->m_count; ++index)
+        {
+            Branch* branch = &node->m_branch[index];
+
+            if (!RaySlab(&branch->m_rect, origin, dir, a_maxT, &t))
+            {
+                continue;
+            }
+
+            if (node->IsInternalNode())
+            {
+                queue.push(make_pair(t, make_pair(branch->m_child, -1)));
+            }
+            else if (!branch->m_dead && (!a_exact || RayGeometry(branch->m_data, origin, dir, a_maxT, &t)))
+            {
+                queue.push(make_pair(t, make_pair(node, index)));
+            }
+        }
+    }
+    return !a_results.empty();
+}
+
+
+bool RTree::RaySlab(const Rect* a_rect, const double a_origin[2], const double a_dir[2], double a_maxT, double* a_tEnter) const
+{
+    double t0 = 0, t1 = a_maxT;
+
+    for (int axis = 0; axis < 2; ++axis)
+    {
+        if (a_dir[axis] == 0)
+        {
+            if (a_origin[axis] < a_rect->m_min[axis] || a_origin[axis] > a_rect->m_max[axis])
+            {
+                return false;
+            }
+            continue;
+        }
+
+        double ta = (a_rect->m_min[axis] - a_origin[axis]) / a_dir[axis];
+        double tb = (a_rect->m_max[axis] - a_origin[axis]) / a_dir[axis];
+        if (ta > tb)
+        {
+            swap(ta, tb);
+        }
+        t0 = Max(t0, ta);
+        t1 = Min(t1, tb);
+        if (t0 > t1)
+        {
+            return false;
+        }
+    }
+
+    *a_tEnter = t0;
+    return true;
+}
+
+
+// A single vertex is tested by its (padded) MBR, as everywhere else.
+bool RTree::RayGeometry(const vector<pair<int, int>>& a_pol, const double a_origin[2], const double a_dir[2], double a_maxT, double* a_tEnter) const
+{
+    if (a_pol.size() == 1)
+    {
+        return true;
+    }
+
+    if (a_pol.size() >= 3 && PointInPolygon(a_pol, a_origin[0], a_origin[1]))
+    {
+        *a_tEnter = 0;
+        return true;
+    }
+
+    bool hit = false;
+    double best = a_maxT;
+    unsigned int edges = a_pol.size() == 2 ? 1 : a_pol.size();
+
+    for (unsigned int i = 0; i < edges; ++i)
+    {
+        double t;
+        if (RaySegment(a_pol[i], a_pol[(i + 1) % a_pol.size()], a_origin, a_dir, &t) && t <= best)
+        {
+            best = t;
+            hit = true;
+        }
+    }
+
+    if (hit)
+    {
+        *a_tEnter = best;
+    }
+    return hit;
+}
+
+
+bool RTree::RaySegment(pair<int, int> a_a, pair<int, int> a_b, const double a_origin[2], const double a_dir[2], double* a_t) const
+{
+    double ax = a_a.first - a_origin[0], ay = a_a.second - a_origin[1];
+    double ex = (double)a_b.first - a_a.first, ey = (double)a_b.second - a_a.second;
+    double denom = a_dir[0] * ey - a_dir[1] * ex;
+
+    if (denom == 0)
+    {
+        if (ax * a_dir[1] - ay * a_dir[0] != 0)
+        {
+            return false;
+        }
+
+        double len = a_dir[0] * a_dir[0] + a_dir[1] * a_dir[1];
+        if (len == 0)
+        {
+            return false;
+        }
+        double ta = (ax * a_dir[0] + ay * a_dir[1]) / len;
+        double tb = ((ax + ex) * a_dir[0] + (ay + ey) * a_dir[1]) / len;
+        if (Max(ta, tb) < 0)
+        {
+            return false;
+        }
+        *a_t = Max(0.0, Min(ta, tb));
         return true;
     }
+
+    double t = (ax * ey - ay * ex) / denom;
+    double u = (ax * a_dir[1] - ay * a_dir[0]) / denom;
+    if (t < 0 || u < 0 || u > 1)
+    {
+        return false;
+    }
+
+    *a_t = t;
+    return true;
+}
+
+
+// Uniform sample, without replacement, of a_k objects whose MBR intersects
+// a_rect (all of them if there are no more than that). The walk stops at
+// branches lying wholly inside the window, so it only visits nodes on the
+// window's boundary; a draw then picks one of those pieces in proportion to
+// its m_size and goes down it by the counts, O(height) per draw whatever the
+// number of hits. Draws that repeat an object are rejected.
+bool RTree::SampleInWindow(const Rect& a_rect, int a_k, mt19937& a_rng, vector<vector<pair<int, int>>>& a_results)
+{
+    a_results.clear();
+    if (a_k <= 0)
+    {
+        return false;
+    }
+
+    vector<pair<const Branch*, long long>> pieces;
+    SampleRec(m_root, a_rect, pieces);
+
+    long long total = pieces.empty() ? 0 : pieces.back().second;
+
+    // Past half the hits, rejecting repeats costs more than listing them all.
+    if (2LL * a_k >= total)
+    {
+        Search(a_rect, a_results);
+        for (int i = 0; i < a_k && i < (int)a_results.size(); ++i)
+        {
+            uniform_int_distribution<int> pick(i, (int)a_results.size() - 1);
+            swap(a_results[i], a_results[pick(a_rng)]);
+        }
+        if ((int)a_results.size() > a_k)
+        {
+            a_results.resize(a_k);
+        }
+        return !a_results.empty();
+    }
+
+    set<const Branch*> taken;
+    uniform_int_distribution<long long> position(0, total - 1);
+
+    while ((int)a_results.size() < a_k)
+    {
+        long long offset = position(a_rng);
+        unsigned int piece = upper_bound(pieces.begin(), pieces.end(), offset,
+            [](long long a_offset, const pair<const Branch*, long long>& a_piece) { return a_offset < a_piece.second; }) - pieces.begin();
+        if (piece > 0)
+        {
+            offset -= pieces[piece - 1].second;
+        }
+
+        const Branch* branch = pieces[piece].first;
+        while (branch->m_child)
+        {
+            Node* node = branch->m_child;
+            int index = 0;
+            while (offset >= BranchSize(&node->m_branch[index]))
+            {
+                offset -= BranchSize(&node->m_branch[index]);
+                ++index;
+            }
+            branch = &node->m_branch[index];
+        }
+
+        if (taken.insert(branch).second)
+        {
+            a_results.push_back(branch->m_data);
+        }
+    }
+    return true;
+}
+
+
+// Appends the live hits and the fully covered subtrees under a_node, each
+// with the running total of objects so far.
+void RTree::SampleRec(Node* a_node, const Rect& a_rect, vector<pair<const Branch*, long long>>& a_pieces)
+{
+    for (int index = 0; index < a_node->m_count; ++index)
+    {
+        const Branch* branch = &a_node->m_branch[index];
+        int size = BranchSize(branch);
+
+        if (size == 0 || !Overlap(&branch->m_rect, &a_rect))
+        {
+            continue;
+        }
+
+        if (a_node->IsInternalNode() && !Overlap2(&a_rect, &branch->m_rect))
+        {
+            SampleRec(branch->m_child, a_rect, a_pieces);
+            continue;
+        }
+
+        long long before = a_pieces.empty() ? 0 : a_pieces.back().second;
+        a_pieces.push_back(make_pair(branch, before + size));
+    }
+}
+
+
+// Answers every window of a_rects in one traversal. Each node is visited
+// once, with the bitmask of windows whose rectangle overlaps it, and a hit is
+// reported once per window it falls in, tagged with that window's index.
+// a_callback can return false to stop. Windows are taken 64 to a pass.
+int RTree::SearchMulti(const vector<Rect>& a_rects, const function<bool(int, const vector<pair<int, int>>&)>& a_callback)
+{
+    int count = 0;
+
+    for (unsigned int first = 0; first < a_rects.size(); first += 64)
+    {
+        int windows = Min((int)(a_rects.size() - first), 64);
+        unsigned long long mask = windows == 64 ? ~0ULL : (1ULL << windows) - 1;
+
+        Rect cover = a_rects[first];
+        for (int window = 1; window < windows; ++window)
+        {
+            cover = CombineRect(&cover, &a_rects[first + window]);
+        }
+
+        if (!MultiRec(m_root, &a_rects[first], first, mask, cover, a_callback, count))
+        {
+            break;
+        }
+    }
+    return count;
+}
+
+
+bool RTree::MultiRec(Node* a_node, const Rect* a_rects, int a_first, unsigned long long a_mask, const Rect& a_cover, const function<bool(int, const vector<pair<int, int>>&)>& a_callback, int& a_count)
+{
+    for (int index = 0; index < a_node->m_count; ++index)
+    {
+        Branch* branch = &a_node->m_branch[index];
+
+        // Branches away from every live window are rejected with one test.
+        if ((a_node->IsLeaf() && branch->m_dead) || !Overlap(&branch->m_rect, &a_cover))
+        {
+            continue;
+        }
+
+        unsigned long long hits = 0;
+        Rect cover;
+        for (int window = 0; window < 64 && (a_mask >> window) != 0; ++window)
+        {
+            if (((a_mask >> window) & 1) && Overlap(&branch->m_rect, &a_rects[window]))
+            {
+                cover = hits == 0 ? a_rects[window] : CombineRect(&cover, &a_rects[window]);
+                hits |= 1ULL << window;
+            }
+        }
+
+        if (hits == 0)
+        {
+            continue;
+        }
+
+        if (a_node->IsInternalNode())
+        {
+            if (!MultiRec(branch->m_child, a_rects, a_first, hits, cover, a_callback, a_count))
+            {
+                return false;
+            }
+            continue;
+        }
+
+        for (int window = 0; window < 64 && (hits >> window) != 0; ++window)
+        {
+            if ((hits >> window) & 1)
+            {
+                ++a_count;
+                if (!a_callback(a_first + window, branch->m_data))
+                {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
 }
 
-void RTree::DisconnectBranch(Node* a_node, int a_index)
-{
-    a_node->m_branch[a_index] = a_node->m_branch[a_node->m_count - 1];
 
-    --a_node->m_count;
+// The a_k pairs (one object from this tree, one from a_other) whose MBRs are
+// closest, nearest first, by squared MINDIST between MBRs as Nearest uses.
+// Node pairs and object pairs share one queue ordered by MINMINDIST. A pair
+// is only queued while it can still beat the current bound on the k-th
+// distance, which drops to MAXMAXDIST of any node pair holding at least a_k
+// object pairs and to the k-th best object pair generated so far. For a_k
+// == 1 the bound also drops to MINMAXDIST of any node pair, unless dead
+// entries may be what holds a node MBR out to one of its faces.
+bool RTree::ClosestPairs(RTree& a_other, int a_k, vector<pair<vector<pair<int, int>>, vector<pair<int, int>>>>& a_pairs)
+{
+    typedef pair<double, pair<pair<Node*, int>, pair<Node*, int>>> QueueItem;
+    priority_queue<QueueItem, vector<QueueItem>, greater<QueueItem>> queue;
+    priority_queue<double> best;
+    double bound = numeric_limits<double>::max();
+    bool minMax = (a_k == 1 && m_deadCount == 0 && a_other.m_deadCount == 0);
+
+    a_pairs.clear();
+    if (a_k <= 0 || NodeSize(m_root) == 0 || NodeSize(a_other.m_root) == 0)
+    {
+        return false;
+    }
+    queue.push(make_pair(0.0, make_pair(make_pair(m_root, -1), make_pair(a_other.m_root, -1))));
+
+    while (!queue.empty() && (int)a_pairs.size() < a_k)
+    {
+        QueueItem item = queue.top();
+        queue.pop();
+
+        Node* nodeA = item.second.first.first;
+        Node* nodeB = item.second.second.first;
+
+        if (item.second.first.second >= 0)
+        {
+            a_pairs.push_back(make_pair(nodeA->m_branch[item.second.first.second].m_data, nodeB->m_branch[item.second.second.second].m_data));
+            continue;
+        }
+        if (item.first > bound)
+        {
+            break;
+        }
+
+        // Go down the taller side, or both when they are level.
+        bool expandA = nodeA->m_level >= nodeB->m_level;
+        bool expandB = nodeB->m_level >= nodeA->m_level;
+        Rect coverA = NodeCover(nodeA);
+        Rect coverB = NodeCover(nodeB);
+
+        for (int indexA = 0; indexA < (expandA ? nodeA->m_count : 1); ++indexA)
+        {
+            const Branch* branchA = expandA ? &nodeA->m_branch[indexA] : NULL;
+            const Rect* rectA = expandA ? &branchA->m_rect : &coverA;
+            int sizeA = expandA ? BranchSize(branchA) : NodeSize(nodeA);
+
+            for (int indexB = 0; indexB < (expandB ? nodeB->m_count : 1) && sizeA > 0; ++indexB)
+            {
+                const Branch* branchB = expandB ? &nodeB->m_branch[indexB] : NULL;
+                const Rect* rectB = expandB ? &branchB->m_rect : &coverB;
+                int sizeB = expandB ? BranchSize(branchB) : NodeSize(nodeB);
+
+                double dist = RectDist(rectA, rectB);
+                if (sizeB == 0 || dist > bound)
+                {
+                    continue;
+                }
+
+                if (nodeA->IsLeaf() && nodeB->IsLeaf())
+                {
+                    queue.push(make_pair(dist, make_pair(make_pair(nodeA, indexA), make_pair(nodeB, indexB))));
+
+                    best.push(dist);
+                    if ((int)best.size() > a_k)
+                    {
+                        best.pop();
+                    }
+                    if ((int)best.size() == a_k)
+                    {
+                        bound = Min(bound, best.top());
+                    }
+                    continue;
+                }
+
+                if (minMax)
+                {
+                    bound = Min(bound, RectMinMaxDist(rectA, rectB));
+                }
+                else if ((long long)sizeA * sizeB >= a_k)
+                {
+                    bound = Min(bound, RectMaxDist(rectA, rectB));
+                }
+
+                Node* childA = expandA ? branchA->m_child : nodeA;
+                Node* childB = expandB ? branchB->m_child : nodeB;
+                queue.push(make_pair(dist, make_pair(make_pair(childA, -1), make_pair(childB, -1))));
+            }
+        }
+    }
+    return !a_pairs.empty();
 }
 
-int RTree::ChooseLeaf(const Rect* a_rect, Node* a_node)
+
+// State of one DistanceJoin task. On a single thread m_lock is NULL and pairs
+// go straight to the callback; worker threads collect up to JOIN_BUFFER pairs
+// in m_pairs and hand them over under m_lock. m_stop is shared by all tasks.
+struct JoinState
 {
+    double m_distance2;
+    const function<bool(const vector<pair<int, int>>&, const vector<pair<int, int>>&)>* m_callback;
+    int m_count;
+    vector<pair<const vector<pair<int, int>>*, const vector<pair<int, int>>*>> m_pairs;
+    mutex* m_lock;
+    atomic<bool>* m_stop;
+};
+
+
+// Streams every pair (one object from this tree, one from a_other) whose MBRs
+// are within a_distance to a_callback, which can return false to stop. The
+// two trees are walked together, dropping node pairs farther apart than
+// a_distance and reporting a node pair wholesale once its MAXMAXDIST is
+// within it. With a_threads > 1 the top node pairs are handed out to that
+// many threads; each buffers up to JOIN_BUFFER pairs and drains them into
+// a_callback under a shared mutex, so the callback never runs concurrently
+// but may be called from any of the threads. Once it returns false every
+// worker stops at its next node pair.
+int RTree::DistanceJoin(RTree& a_other, double a_distance, const function<bool(const vector<pair<int, int>>&, const vector<pair<int, int>>&)>& a_callback, int a_threads)
+{
+    mutex lock;
+    atomic<bool> stop(false);
 
-    bool firstTime = true;
-    float increase;
-    float bestIncr = (float)-1;
-    float area;
-    float bestArea;
-    int best = 0;
-    Rect tempRect;
+    JoinState state;
+    state.m_distance2 = a_distance * a_distance;
+    state.m_callback = &a_callback;
+    state.m_count = 0;
+    state.m_lock = NULL;
+    state.m_stop = &stop;
 
-    for (int index = 0; index < a_node->m_count; ++index)
-    {
-        Rect* curRect = &a_node->m_branch[index].m_rect;
+    vector<pair<Node*, Node*>> tasks(1, make_pair(m_root, a_other.m_root));
 
-        area = CalcRectArea(curRect);
-        tempRect = CombineRect(a_rect, curRect);
-        increase = CalcRectArea(&tempRect) - area;
-        if ((increase < bestIncr) || firstTime)
+    // Split the top of the join until every thread has a few pairs to take.
+    for (bool split = a_threads > 1; split && (int)tasks.size() < 4 * a_threads; )
+    {
+        vector<pair<Node*, Node*>> next;
+        split = false;
+        for (unsigned int i = 0; i < tasks.size(); ++i)
         {
-            best = index;
-            bestArea = area;
-            bestIncr = increase;
-            firstTime = false;
+            Node* nodeA = tasks[i].first;
+            Node* nodeB = tasks[i].second;
+            if (nodeA->IsLeaf() && nodeB->IsLeaf())
+            {
+                next.push_back(tasks[i]);
+                continue;
+            }
+
+            bool expandA = nodeA->m_level >= nodeB->m_level;
+            bool expandB = nodeB->m_level >= nodeA->m_level;
+            Rect coverA = NodeCover(nodeA);
+            Rect coverB = NodeCover(nodeB);
+
+            for (int indexA = 0; indexA < (expandA ? nodeA->m_count : 1); ++indexA)
+            {
+                for (int indexB = 0; indexB < (expandB ? nodeB->m_count : 1); ++indexB)
+                {
+                    const Rect* rectA = expandA ? &nodeA->m_branch[indexA].m_rect : &coverA;
+                    const Rect* rectB = expandB ? &nodeB->m_branch[indexB].m_rect : &coverB;
+                    if (RectDist(rectA, rectB) <= state.m_distance2)
+                    {
+                        next.push_back(make_pair(expandA ? nodeA->m_branch[indexA].m_child : nodeA,
+                            expandB ? nodeB->m_branch[indexB].m_child : nodeB));
+                    }
+                }
+            }
+            split = true;
         }
-        else if ((increase == bestIncr) && (area < bestArea))
+        tasks.swap(next);
+    }
+
+    if (a_threads <= 1)
+    {
+        for (unsigned int i = 0; i < tasks.size() && JoinRec(tasks[i].first, tasks[i].second, state); ++i)
         {
-            best = index;
-            bestArea = area;
-            bestIncr = increase;
         }
+        return state.m_count;
     }
-    return best;
-}
 
-Rect RTree::CombineRect(const Rect* a_rectA, const Rect* a_rectB)
-{
+    vector<JoinState> states(a_threads, state);
+    for (int t = 0; t < a_threads; ++t)
+    {
+        states[t].m_lock = &lock;
+        states[t].m_pairs.reserve(JOIN_BUFFER);
+    }
 
-    Rect newRect;
+    atomic<int> next(0);
+    auto worker = [&](JoinState& a_state)
+    {
+        for (int index = next++; index < (int)tasks.size() && !stop; index = next++)
+        {
+            JoinRec(tasks[index].first, tasks[index].second, a_state);
+        }
+        JoinFlush(a_state);
+    };
 
-    for (int index = 0; index < 2; ++index)
+    vector<thread> threads;
+    for (int t = 1; t < a_threads; ++t)
     {
-        newRect.m_min[index] = Min(a_rectA->m_min[index], a_rectB->m_min[index]);
-        newRect.m_max[index] = Max(a_rectA->m_max[index], a_rectB->m_max[index]);
+        threads.push_back(thread(worker, ref(states[t])));
+    }
+    worker(states[0]);
+    for (unsigned int t = 0; t < threads.size(); ++t)
+    {
+        threads[t].join();
     }
 
-    return newRect;
+    int count = 0;
+    for (int t = 0; t < a_threads; ++t)
+    {
+        count += states[t].m_count;
+    }
+    return count;
 }
 
-void RTree::SplitNode(Node* a_node, const Branch* a_branch, Node** a_newNode)
+
+bool RTree::JoinRec(Node* a_nodeA, Node* a_nodeB, JoinState& a_state)
 {
-    PartitionVars localVars;
-    PartitionVars* parVars = &localVars;
+    if (*a_state.m_stop)
+    {
+        return false;
+    }
 
-    GetBranches(a_node, a_branch, parVars);
+    bool expandA = a_nodeA->m_level >= a_nodeB->m_level;
+    bool expandB = a_nodeB->m_level >= a_nodeA->m_level;
+    Rect coverA = expandA ? Rect() : NodeCover(a_nodeA);
+    Rect coverB = expandB ? Rect() : NodeCover(a_nodeB);
 
-    QuadraticSplit(parVars, MINNODES);
+    for (int indexA = 0; indexA < (expandA ? a_nodeA->m_count : 1); ++indexA)
+    {
+        Branch* branchA = expandA ? &a_nodeA->m_branch[indexA] : NULL;
+        const Rect* rectA = expandA ? &branchA->m_rect : &coverA;
 
-    *a_newNode = AllocNode();
-    (*a_newNode)->m_level = a_node->m_level;
+        if (branchA && BranchSize(branchA) == 0)
+        {
+            continue;
+        }
 
-    a_node->m_count = 0;
-    LoadNodes(a_node, *a_newNode, parVars);
+        for (int indexB = 0; indexB < (expandB ? a_nodeB->m_count : 1); ++indexB)
+        {
+            Branch* branchB = expandB ? &a_nodeB->m_branch[indexB] : NULL;
+            const Rect* rectB = expandB ? &branchB->m_rect : &coverB;
+
+            if ((branchB && BranchSize(branchB) == 0) || RectDist(rectA, rectB) > a_state.m_distance2)
+            {
+                continue;
+            }
+
+            Node* childA = expandA ? branchA->m_child : a_nodeA;
+            Node* childB = expandB ? branchB->m_child : a_nodeB;
+
+            if (a_nodeA->IsLeaf() && a_nodeB->IsLeaf())
+            {
+                if (!JoinReport(&branchA->m_data, &branchB->m_data, a_state))
+                {
+                    return false;
+                }
+                continue;
+            }
+
+            if (RectMaxDist(rectA, rectB) <= a_state.m_distance2)
+            {
+                vector<const vector<pair<int, int>>*> objectsA, objectsB;
+                if (childA)
+                {
+                    ObjectsRec(childA, objectsA);
+                }
+                else
+                {
+                    objectsA.push_back(&branchA->m_data);
+                }
+                if (childB)
+                {
+                    ObjectsRec(childB, objectsB);
+                }
+                else
+                {
+                    objectsB.push_back(&branchB->m_data);
+                }
 
+                for (unsigned int i = 0; i < objectsA.size(); ++i)
+                {
+                    for (unsigned int j = 0; j < objectsB.size(); ++j)
+                    {
+                        if (!JoinReport(objectsA[i], objectsB[j], a_state))
+                        {
+                            return false;
+                        }
+                    }
+                }
+                continue;
+            }
+
+            if (!JoinRec(childA, childB, a_state))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
 }
-float RTree::CalcRectArea(Rect* a_rect)
-{
-    float area;
 
-    area = ((float)a_rect->m_max[0] - (float)a_rect->m_min[0]) * ((float)a_rect->m_max[1] - (float)a_rect->m_min[1]);
 
-  return area;
+bool RTree::JoinReport(const vector<pair<int, int>>* a_objA, const vector<pair<int, int>>* a_objB, JoinState& a_state)
+{
+    if (a_state.m_lock)
+    {
+        a_state.m_pairs.push_back(make_pair(a_objA, a_objB));
+        return a_state.m_pairs.size() < JOIN_BUFFER || JoinFlush(a_state);
+    }
+
+    ++a_state.m_count;
+    if (!(*a_state.m_callback)(*a_objA, *a_objB))
+    {
+        *a_state.m_stop = true;
+        return false;
+    }
+    return true;
 }
 
 
-void RTree::GetBranches(Node* a_node, const Branch* a_branch, PartitionVars* a_parVars)
+// Hands a worker's buffered pairs to the callback under the shared lock,
+// dropping them if another worker's callback has already said stop.
+bool RTree::JoinFlush(JoinState& a_state)
 {
+    lock_guard<mutex> guard(*a_state.m_lock);
 
-    for (int index = 0; index < MAXNODES; ++index)
+    for (unsigned int i = 0; i < a_state.m_pairs.size() && !*a_state.m_stop; ++i)
     {
-        a_parVars->m_branchBuf[index] = a_node->m_branch[index];
+        ++a_state.m_count;
+        if (!(*a_state.m_callback)(*a_state.m_pairs[i].first, *a_state.m_pairs[i].second))
+        {
+            *a_state.m_stop = true;
+        }
     }
-    a_parVars->m_branchBuf[MAXNODES] = *a_branch;
-    a_parVars->m_branchCount = MAXNODES + 1;
+    a_state.m_pairs.clear();
+    return !*a_state.m_stop;
+}
 
-    a_parVars->m_coverSplit = a_parVars->m_branchBuf[0].m_rect;
-    for (int index = 1; index < MAXNODES + 1; ++index)
+
+// Like ReportRec, but hands out the live objects in place.
+void RTree::ObjectsRec(Node* a_node, vector<const vector<pair<int, int>>*>& a_objects)
+{
+    for (int index = 0; index < a_node->m_count; ++index)
     {
-        a_parVars->m_coverSplit = CombineRect(&a_parVars->m_coverSplit, &a_parVars->m_branchBuf[index].m_rect);
+        if (a_node->IsInternalNode())
+        {
+            ObjectsRec(a_node->m_branch[index].m_child, a_objects);
+        }
+        else if (!a_node->m_branch[index].m_dead)
+        {
+            a_objects.push_back(&a_node->m_branch[index].m_data);
+        }
     }
-    a_parVars->m_coverSplitArea = CalcRectArea(&a_parVars->m_coverSplit);
 }
 
 
-void RTree::QuadraticSplit(PartitionVars* a_parVars, int a_minFill)
+// Squared MINDIST between two rectangles (MINMINDIST for node MBRs).
+double RTree::RectDist(const Rect* a_rectA, const Rect* a_rectB) const
 {
-    float biggestDiff;
-    int group, chosen = 0, betterGroup = 0;
+    double dx = Max(0.0, Max((double)a_rectA->m_min[0] - a_rectB->m_max[0], (double)a_rectB->m_min[0] - a_rectA->m_max[0]));
+    double dy = Max(0.0, Max((double)a_rectA->m_min[1] - a_rectB->m_max[1], (double)a_rectB->m_min[1] - a_rectA->m_max[1]));
 
-    InitParVars(a_parVars, a_parVars->m_branchCount, a_minFill);
-    PickSeeds(a_parVars);
+    return dx * dx + dy * dy;
+}
 
-    while (((a_parVars->m_count[0] + a_parVars->m_count[1]) < a_parVars->m_total)
-        && (a_parVars->m_count[0] < (a_parVars->m_total - a_parVars->m_minFill))
-        && (a_parVars->m_count[1] < (a_parVars->m_total - a_parVars->m_minFill)))
+
+// Squared MAXMAXDIST: no two points of the rectangles are farther apart.
+double RTree::RectMaxDist(const Rect* a_rectA, const Rect* a_rectB) const
+{
+    double dx = Max((double)a_rectA->m_max[0] - a_rectB->m_min[0], (double)a_rectB->m_max[0] - a_rectA->m_min[0]);
+    double dy = Max((double)a_rectA->m_max[1] - a_rectB->m_min[1], (double)a_rectB->m_max[1] - a_rectA->m_min[1]);
+
+    return dx * dx + dy * dy;
+}
+
+
+// Squared MINMAXDIST of two MBRs: every side of an MBR touches something
+// inside it, so some pair of objects is no farther apart than the farthest
+// points of any side of one and any side of the other. Two segments are
+// farthest apart at their end points.
+double RTree::RectMinMaxDist(const Rect* a_rectA, const Rect* a_rectB) const
+{
+    // Sides as (x0, y0, x1, y1): left, right, bottom, top.
+    double ax0 = a_rectA->m_min[0], ay0 = a_rectA->m_min[1], ax1 = a_rectA->m_max[0], ay1 = a_rectA->m_max[1];
+    double bx0 = a_rectB->m_min[0], by0 = a_rectB->m_min[1], bx1 = a_rectB->m_max[0], by1 = a_rectB->m_max[1];
+    double sidesA[4][4] = { { ax0, ay0, ax0, ay1 }, { ax1, ay0, ax1, ay1 }, { ax0, ay0, ax1, ay0 }, { ax0, ay1, ax1, ay1 } };
+    double sidesB[4][4] = { { bx0, by0, bx0, by1 }, { bx1, by0, bx1, by1 }, { bx0, by0, bx1, by0 }, { bx0, by1, bx1, by1 } };
+
+    double best = numeric_limits<double>::max();
+    for (int sideA = 0; sideA < 4; ++sideA)
     {
-        biggestDiff = (float)-1;
-        for (int index = 0; index<a_parVars->m_total; ++index)
+        for (int sideB = 0; sideB < 4; ++sideB)
         {
-            if (PartitionVars::NOT_TAKEN == a_parVars->m_partition[index])
+            double farthest = 0;
+            for (int endA = 0; endA < 2; ++endA)
             {
-                Rect* curRect = &a_parVars->m_branchBuf[index].m_rect;
-                Rect rect0 = CombineRect(curRect, &a_parVars->m_cover[0]);
-                Rect rect1 = CombineRect(curRect, &a_parVars->m_cover[1]);
-                float growth0 = CalcRectArea(&rect0) - a_parVars->m_area[0];
-                float growth1 = CalcRectArea(&rect1) - a_parVars->m_area[1];
-                float diff = growth1 - growth0;
-                if (diff >= 0)
-                {
-                    group = 0;
-                }
-                else
-                {
-                    group = 1;
-                    diff = -diff;
-                }
-
-                if (diff > biggestDiff)
-                {
-                    biggestDiff = diff;
-                    chosen = index;
-                    betterGroup = group;
-                }
-                else if ((diff == biggestDiff) && (a_parVars->m_count[group] < a_parVars->m_count[betterGroup]))
+                for (int endB = 0; endB < 2; ++endB)
                 {
-                    chosen = index;
-                    betterGroup = group;
+                    double dx = sidesA[sideA][2 * endA] - sidesB[sideB][2 * endB];
+                    double dy = sidesA[sideA][2 * endA + 1] - sidesB[sideB][2 * endB + 1];
+                    farthest = Max(farthest, dx * dx + dy * dy);
                 }
             }
+            best = Min(best, farthest);
         }
-        Classify(chosen, betterGroup, a_parVars);
     }
+    return best;
+}
 
-    if ((a_parVars->m_count[0] + a_parVars->m_count[1]) < a_parVars->m_total)
+
+// Streams every object within a_radius of a_center to a_callback, which can
+// return false to stop. A node whose MBR lies entirely in the circle (MAXDIST
+// <= r) is reported without further tests. Without a_exact the leaf test is
+// MINDIST of the MBR; with it, distance to the geometry itself.
+int RTree::SearchRadius(pair<int, int> a_center, double a_radius, const function<bool(const vector<pair<int, int>>&)>& a_callback, bool a_exact)
+{
+    int count = 0;
+    RadiusRec(m_root, a_center.first, a_center.second, a_radius * a_radius, a_callback, a_exact, false, count);
+    return count;
+}
+
+
+bool RTree::RadiusRec(Node* a_node, int a_x, int a_y, double a_radius2, const function<bool(const vector<pair<int, int>>&)>& a_callback, bool a_exact, bool a_inside, int& a_count)
+{
+    for (int index = 0; index < a_node->m_count; ++index)
     {
-        if (a_parVars->m_count[0] >= a_parVars->m_total - a_parVars->m_minFill)
-        {
-            group = 1;
-        }
-        else
+        Branch* branch = &a_node->m_branch[index];
+        bool inside = a_inside;
+
+        if (!inside)
         {
-            group = 0;
+            if (MinDist(&branch->m_rect, a_x, a_y) > a_radius2)
+            {
+                continue;
+            }
+            inside = MaxDist(&branch->m_rect, a_x, a_y) <= a_radius2;
         }
-        for (int index = 0; index<a_parVars->m_total; ++index)
+
+        if (a_node->IsInternalNode())
         {
-            if (PartitionVars::NOT_TAKEN == a_parVars->m_partition[index])
+            if (!RadiusRec(branch->m_child, a_x, a_y, a_radius2, a_callback, a_exact, inside, a_count))
             {
-                Classify(index, group, a_parVars);
+                return false;
             }
+            continue;
+        }
+
+        if (branch->m_dead)
+        {
+            continue;
+        }
+        if (!inside && a_exact && GeometryDist(branch->m_data, a_x, a_y) > a_radius2)
+        {
+            continue;
+        }
+
+        ++a_count;
+        if (!a_callback(branch->m_data))
+        {
+            return false;
         }
     }
+    return true;
 }
 
 
-void RTree::LoadNodes(Node* a_nodeA, Node* a_nodeB, PartitionVars* a_parVars)
+double RTree::MaxDist(const Rect* a_rect, int a_x, int a_y) const
 {
+    double dx = Max(fabs((double)a_x - a_rect->m_min[0]), fabs((double)a_x - a_rect->m_max[0]));
+    double dy = Max(fabs((double)a_y - a_rect->m_min[1]), fabs((double)a_y - a_rect->m_max[1]));
 
+    return dx * dx + dy * dy;
+}
 
-    for (int index = 0; index < a_parVars->m_total; ++index)
-    {
 
-        int targetNodeIndex = a_parVars->m_partition[index];
-        Node* targetNodes[] = { a_nodeA, a_nodeB };
+// Squared distance from the point to a point, segment or polygon (0 inside).
+double RTree::GeometryDist(const vector<pair<int, int>>& a_pol, int a_x, int a_y) const
+{
+    if (a_pol.size() >= 3 && PointInPolygon(a_pol, a_x, a_y))
+    {
+        return 0;
+    }
 
-        bool nodeWasSplit = AddBranch(&a_parVars->m_branchBuf[index], targetNodes[targetNodeIndex], NULL);
+    if (a_pol.size() == 1)
+    {
+        double dx = (double)a_pol[0].first - a_x, dy = (double)a_pol[0].second - a_y;
+        return dx * dx + dy * dy;
     }
-}
 
-void RTree::InitParVars(PartitionVars* a_parVars, int a_maxRects, int a_minFill)
-{
-    a_parVars->m_count[0] = a_parVars->m_count[1] = 0;
-    a_parVars->m_area[0] = a_parVars->m_area[1] = (float)0;
-    a_parVars->m_total = a_maxRects;
-    a_parVars->m_minFill = a_minFill;
-    for (int index = 0; index < a_maxRects; ++index)
+    double best = numeric_limits<double>::max();
+    unsigned int edges = a_pol.size() == 2 ? 1 : a_pol.size();
+
+    for (unsigned int i = 0; i < edges; ++i)
     {
-        a_parVars->m_partition[index] = PartitionVars::NOT_TAKEN;
+        double ax = a_pol[i].first, ay = a_pol[i].second;
+        double ex = a_pol[(i + 1) % a_pol.size()].first - ax, ey = a_pol[(i + 1) % a_pol.size()].second - ay;
+        double len = ex * ex + ey * ey;
+        double t = len > 0 ? ((a_x - ax) * ex + (a_y - ay) * ey) / len : 0;
+        t = Max(0.0, Min(1.0, t));
+
+        double dx = ax + t * ex - a_x, dy = ay + t * ey - a_y;
+        best = Min(best, dx * dx + dy * dy);
     }
+    return best;
 }
 
 
-void RTree::PickSeeds(PartitionVars* a_parVars)
+// Repacks the worst-scoring subtrees (see NodeScore) until about a_budget
+// leaf entries have been moved. One walk over the levels above the highest
+// one whose subtrees still fit the budget scores the subtrees there and
+// keeps a handle on each; they are then taken worst first, re-scored and
+// repacked in place (RepackSubtree) if still above the threshold set by
+// SetAutoReorganize. A repack that dissolves its subtree restructures the
+// nodes above it, so a handle whose path no longer leads to its node is
+// skipped rather than looked up again.
+int RTree::Reorganize(int a_budget)
 {
-    int seed0 = 0, seed1 = 0;
-    float worst, waste;
-    float area[MAXNODES + 1];
-
-    for (int index = 0; index<a_parVars->m_total; ++index)
+    if (m_root->m_level < 2)
     {
-        area[index] = CalcRectArea(&a_parVars->m_branchBuf[index].m_rect);
+        return 0;
     }
 
-    worst = -a_parVars->m_coverSplitArea - 1;
-    for (int indexA = 0; indexA < a_parVars->m_total - 1; ++indexA)
+    vector<pair<Node*, int>> path;
+    vector<pair<float, SubtreeHandle>> candidates;
+    ScoreSubtreesRec(m_root, Min(ReorgLevel(a_budget), m_root->m_level - 1), path, candidates);
+    sort(candidates.begin(), candidates.end(),
+        [](const pair<float, SubtreeHandle>& a, const pair<float, SubtreeHandle>& b) { return a.first > b.first; });
+
+    int moved = 0;
+    for (unsigned int i = 0; i < candidates.size() && moved < a_budget; ++i)
     {
-        for (int indexB = indexA + 1; indexB < a_parVars->m_total; ++indexB)
+        SubtreeHandle& handle = candidates[i].second;
+        if (SubtreeAt(handle.m_path) == handle.m_node && NodeScore(handle.m_node) > m_reorgThreshold)
         {
-            Rect oneRect = CombineRect(&a_parVars->m_branchBuf[indexA].m_rect, &a_parVars->m_branchBuf[indexB].m_rect);
-            waste = CalcRectArea(&oneRect) - area[indexA] - area[indexB];
-            if (waste > worst)
-            {
-                worst = waste;
-                seed0 = indexA;
-                seed1 = indexB;
-            }
+            moved += RepackSubtree(handle.m_path);
         }
     }
-
-    Classify(seed0, 0, a_parVars);
-    Classify(seed1, 1, a_parVars);
+    return moved;
 }
 
 
-void RTree::Classify(int a_index, int a_group, PartitionVars* a_parVars)
+// Highest level whose subtrees hold at most about a_budget entries; never
+// below 1, whose subtrees hold up to MAXNODES * MAXNODES.
+int RTree::ReorgLevel(int a_budget) const
 {
-    a_parVars->m_partition[a_index] = a_group;
-
-    if (a_parVars->m_count[a_group] == 0)
-    {
-        a_parVars->m_cover[a_group] = a_parVars->m_branchBuf[a_index].m_rect;
-    }
-    else
+    int level = 1;
+    for (long long size = (long long)MAXNODES * MAXNODES * MAXNODES; size <= a_budget; size *= MAXNODES)
     {
-        a_parVars->m_cover[a_group] = CombineRect(&a_parVars->m_branchBuf[a_index].m_rect, &a_parVars->m_cover[a_group]);
+        ++level;
     }
-
-    a_parVars->m_area[a_group] = CalcRectArea(&a_parVars->m_cover[a_group]);
-
-    ++a_parVars->m_count[a_group];
+    return level;
 }
 
-bool RTree::RemoveRect(Rect* a_rect, const vector<pair<int, int>>& a_id, Node** a_root)
-{
-    ListNode* reInsertList = NULL;
 
-    if (!DeleteRec(a_rect, a_id, *a_root, &reInsertList))
+void RTree::ScoreSubtreesRec(Node* a_node, int a_level, vector<pair<Node*, int>>& a_path, vector<pair<float, SubtreeHandle>>& a_candidates)
+{
+    for (int index = 0; index < a_node->m_count; ++index)
     {
-        while (reInsertList)
-        {
-            Node* tempNode = reInsertList->m_node;
+        Node* child = a_node->m_branch[index].m_child;
+        a_path.push_back(make_pair(a_node, index));
 
-            for (int index = 0; index < tempNode->m_count; ++index)
+        if (child->m_level > a_level)
+        {
+            ScoreSubtreesRec(child, a_level, a_path, a_candidates);
+        }
+        else if (child->IsInternalNode())
+        {
+            float score = NodeScore(child);
+            if (score > m_reorgThreshold)
             {
-                InsertRect(tempNode->m_branch[index],
-                    a_root,
-                    tempNode->m_level);
+                SubtreeHandle handle;
+                handle.m_path = a_path;
+                handle.m_node = child;
+                a_candidates.push_back(make_pair(score, handle));
             }
-
-            ListNode* remLNode = reInsertList;
-            reInsertList = reInsertList->m_next;
-
-            FreeNode(remLNode->m_node);
-            FreeListNode(remLNode);
         }
+        a_path.pop_back();
+    }
+}
 
-        if ((*a_root)->m_count == 1 && (*a_root)->IsInternalNode())
-        {
-            Node* tempNode = (*a_root)->m_branch[0].m_child;
 
-            FreeNode(*a_root);
-            *a_root = tempNode;
-        }
-        return false;
-    }
-    else
+// Walks a_path from the root and returns the child its last element names,
+// or NULL if the tree no longer has that path (a node on it was split,
+// dissolved or freed since). Only nodes reached from the root are read.
+Node* RTree::SubtreeAt(const vector<pair<Node*, int>>& a_path) const
+{
+    Node* node = m_root;
+    for (unsigned int k = 0; k < a_path.size(); ++k)
     {
-        return true;
+        if (a_path[k].first != node || !node->IsInternalNode() || a_path[k].second >= node->m_count)
+        {
+            return NULL;
+        }
+        node = node->m_branch[a_path[k].second].m_child;
     }
+    return a_path.empty() ? NULL : node;
 }
 
-bool RTree::DeleteRec(Rect* a_rect, const vector<pair<int, int>>& a_id, Node* a_node, ListNode** a_listNode)
+
+// Called after every successful insert and remove (lazy ones included),
+// with m_updatePath holding the path that update took. The subtree it
+// passed through at the reorganize level joins a short list of candidates;
+// candidates are dropped once their path no longer leads to them or they
+// score at or below the threshold, and one above it is repacked once the
+// credit earned at one entry per update covers its size. A step thus costs
+// one path walk per candidate plus at most one repack of about a_budget
+// entries, and the entries moved stay around one per update.
+void RTree::AutoReorganize()
 {
+    if (m_autoReorgBudget <= 0)
+    {
+        return;
+    }
 
-    if (a_node->IsInternalNode())
+    m_reorgCredit = Min(m_reorgCredit + 1, m_autoReorgBudget);
+
+    int depth = m_root->m_level - Min(ReorgLevel(m_autoReorgBudget), m_root->m_level - 1);
+    if (m_root->m_level >= 2 && (int)m_updatePath.size() >= depth)
     {
-        for (int index = 0; index < a_node->m_count; ++index)
+        SubtreeHandle handle;
+        handle.m_path.assign(m_updatePath.begin(), m_updatePath.begin() + depth);
+        handle.m_node = SubtreeAt(handle.m_path);
+
+        if (handle.m_node != NULL)
         {
-            if (Overlap(a_rect, &(a_node->m_branch[index].m_rect)))
+            for (unsigned int i = 0; i < m_reorgDirty.size(); ++i)
             {
-                if (!DeleteRec(a_rect, a_id, a_node->m_branch[index].m_child, a_listNode))
+                if (m_reorgDirty[i].m_node == handle.m_node)
                 {
-                    if (a_node->m_branch[index].m_child->m_count >= MINNODES)
-                    {
-
-                        a_node->m_branch[index].m_rect = NodeCover(a_node->m_branch[index].m_child);
-                    }
-                    else
-                    {
-
-                        ReInsert(a_node->m_branch[index].m_child, a_listNode);
-                        DisconnectBranch(a_node, index);
-                    }
-                    return false;
+                    m_reorgDirty.erase(m_reorgDirty.begin() + i);
+                    break;
                 }
             }
-        }
-        return true;
-    }
-    else
-    {
-        for (int index = 0; index < a_node->m_count; ++index)
-        {
-            if (a_node->m_branch[index].m_data == a_id)
+            if (m_reorgDirty.size() >= REORG_DIRTY)
             {
-                for(auto it = mObjs.begin(); it != mObjs.end(); ++it) {
-                    if (*it == a_id) {
-                        mObjs.erase(it);
-                        break;
-                    }
-                }
-                DisconnectBranch(a_node, index);
-                return false;
+                m_reorgDirty.erase(m_reorgDirty.begin());
             }
+            m_reorgDirty.push_back(handle);
         }
-        return true;
     }
-}
-
 
-bool RTree::Overlap(const Rect* a_rectA, const Rect* a_rectB) const
-{
-    for (int index = 0; index < 2; ++index)
+    while (!m_reorgDirty.empty())
     {
-        if (a_rectA->m_min[index] > a_rectB->m_max[index] ||
-            a_rectB->m_min[index] > a_rectA->m_max[index])
+        SubtreeHandle& handle = m_reorgDirty.back();
+        if (SubtreeAt(handle.m_path) != handle.m_node || NodeScore(handle.m_node) <= m_reorgThreshold)
         {
-            return false;
+            m_reorgDirty.pop_back();
+            continue;
         }
-    }
-    return true;
-}
 
-bool RTree::Overlap2(Rect* a_rectA, Rect* a_rectB) const
-{
+        Branch* branch = &handle.m_path.back().first->m_branch[handle.m_path.back().second];
+        if (branch->m_size > m_reorgCredit)
+        {
+            return;
+        }
 
-    if (a_rectA->m_min[0] <= a_rectB->m_min[0] &&
-        a_rectB->m_max[0] <= a_rectA->m_max[0] &&
-        a_rectA->m_min[1] <= a_rectB->m_min[1] &&
-        a_rectB->m_max[1] <= a_rectA->m_max[1]){
-        return true;
-    } else {
-        return false;
+        vector<pair<Node*, int>> path;
+        path.swap(handle.m_path);
+        m_reorgDirty.pop_back();
+        m_reorgCredit -= RepackSubtree(path);
+        return;
     }
 }
 
-void RTree::ReInsert(Node* a_node, ListNode** a_listNode)
-{
-    ListNode* newListNode;
-
-    newListNode = AllocListNode();
-    newListNode->m_node = a_node;
-    newListNode->m_next = *a_listNode;
-    *a_listNode = newListNode;
-}
-
 
-bool RTree::Search(const Rect& a_rect, vector<vector<pair<int, int>>>& a_results)
+// With a_budget > 0, inserts and removes feed AutoReorganize: subtrees of
+// up to about a_budget entries around each update are repacked once they
+// score above a_threshold, moving around one entry per update on average.
+// The budget is raised to MAXNODES * MAXNODES, the most a subtree at the
+// lowest level it repacks can hold, so the credit can always cover one.
+void RTree::SetAutoReorganize(float a_threshold, int a_budget)
 {
-    a_results.clear();
-    SearchRec(m_root, a_rect, a_results);
-    return !a_results.empty();
+    m_reorgThreshold = a_threshold;
+    m_autoReorgBudget = a_budget > 0 ? Max(a_budget, MAXNODES * MAXNODES) : a_budget;
+    m_reorgCredit = 0;
+    m_reorgDirty.clear();
 }
 
 
-void RTree::SearchRec(Node* a_node, const Rect& a_rect, vector<vector<pair<int, int>>>& a_results)
+// Pairwise overlap of the children's MBRs relative to the node's cover,
+// plus the share of unused branch slots.
+float RTree::NodeScore(Node* a_node)
 {
+    Rect cover = NodeCover(a_node);
+    float coverArea = CalcRectArea(&cover);
+    float overlap = 0;
 
-    if (a_node->IsInternalNode())
+    for (int indexA = 0; indexA < a_node->m_count - 1; ++indexA)
     {
-        for (int index = 0; index < a_node->m_count; ++index)
+        for (int indexB = indexA + 1; indexB < a_node->m_count; ++indexB)
         {
-            if (Overlap(&a_node->m_branch[index].m_rect, &a_rect))
+            Rect* rectA = &a_node->m_branch[indexA].m_rect;
+            Rect* rectB = &a_node->m_branch[indexB].m_rect;
+            if (Overlap(rectA, rectB))
             {
-                SearchRec(a_node->m_branch[index].m_child, a_rect, a_results);
+                Rect inter;
+                for (int axis = 0; axis < 2; ++axis)
+                {
+                    inter.m_min[axis] = Max(rectA->m_min[axis], rectB->m_min[axis]);
+                    inter.m_max[axis] = Min(rectA->m_max[axis], rectB->m_max[axis]);
+                }
+                overlap += CalcRectArea(&inter);
             }
         }
     }
-    else
+
+    float score = 1.0f - (float)a_node->m_count / MAXNODES;
+    if (coverArea > 0)
     {
-        for (int index = 0; index < a_node->m_count; ++index)
-        {
-            if (Overlap(&a_node->m_branch[index].m_rect, &a_rect))
-            {
-                a_results.push_back(a_node->m_branch[index].m_data);
-            }
-        }
+        score += overlap / coverArea;
     }
+    return score;
 }
 
 
-bool RTree::getMBRs(vector<vector<vector<pair<int, int>>>>& mbrs_n)
+// a_path runs from the root down; its last element names the subtree to
+// repack. Its live entries are Hilbert-sorted and packed into a fresh
+// subtree of the same height, which takes the old one's place (so nothing
+// above it changes shape) only if SubtreeCost expects fewer node visits
+// from it for windows about as wide as the entries are spaced (the side of
+// the cover's area per entry). The packed subtree has fewer nodes and less
+// margin, but its one-child nodes over the whole cover add area, so it is
+// rarely cheaper for every window size. If dead entries leave too few to
+// fill a subtree of that height, it is dissolved and its entries reinserted
+// instead. Returns the number of entries looked at.
+int RTree::RepackSubtree(vector<pair<Node*, int>>& a_path)
 {
-    vector<Branch> current_level_branches, next_level_branches;
-    mbrs_n.clear();
-    vector<vector<pair<int, int>>> current_mbrs;
+    vector<Branch> orphans;
+    vector<vector<pair<int, int>>> removed;
 
-    if (m_root->m_count == 0) return true;
+    Node* parent = a_path.back().first;
+    int index = a_path.back().second;
+    Node* old = parent->m_branch[index].m_child;
+    int level = old->m_level;
 
-    for (int i = 0; i < m_root->m_count; i++) {
-        current_level_branches.push_back(m_root->m_branch[i]);
+    long long minEntries = 1;
+    for (int k = 0; k <= level; ++k)
+    {
+        minEntries *= MINNODES;
     }
 
-    int current_level = m_root->m_level;
-
-    while (!current_level_branches.empty()) {
-        current_mbrs.clear();
-        next_level_branches.clear();
+    LeafBranchesRec(old, orphans);
 
-        for (unsigned int i = 0; i < current_level_branches.size(); i++) {
-            Branch& b = current_level_branches[i];
+    if ((long long)orphans.size() >= minEntries && !orphans.empty())
+    {
+        SortHilbert(orphans);
+
+        // The sorted copies live alongside the old subtree and the new one.
+        size_t buffered = BranchBytes(orphans);
+        TrackBytes(buffered);
+        Node* fresh = PackRec(orphans, 0, (int)orphans.size(), level);
+        TrackBytes(-(long long)buffered);
+
+        double oldArea = 0, oldMargin = 0, freshArea = 0, freshMargin = 0;
+        int oldNodes = 0, freshNodes = 0;
+        SubtreeCost(old, oldArea, oldMargin, oldNodes);
+        SubtreeCost(fresh, freshArea, freshMargin, freshNodes);
+
+        Rect* cover = &parent->m_branch[index].m_rect;
+        double side = sqrt(CalcRectArea(cover) / orphans.size());
+        if (freshArea + side * (freshMargin + side * freshNodes) >= oldArea + side * (oldMargin + side * oldNodes))
+        {
+            vector<Branch> discard;
+            OrphanRec(fresh, discard, removed);
+            return (int)orphans.size();
+        }
 
-            vector<pair<int, int>> q;
-            pair<int, int> p;
+        vector<Branch> discard;
+        OrphanRec(old, discard, removed);
+        parent->m_branch[index].m_child = fresh;
+        parent->m_branch[index].m_rect = NodeCover(fresh);
+        parent->m_branch[index].m_size = NodeSize(fresh);
 
-            p.first = b.m_rect.m_min[0];
-            p.second = b.m_rect.m_min[1];
-            q.push_back(p);
+        for (int k = (int)a_path.size() - 2; k >= 0; --k)
+        {
+            Node* ancestor = a_path[k].first;
+            ancestor->m_branch[a_path[k].second].m_rect = NodeCover(a_path[k + 1].first);
+            ancestor->m_branch[a_path[k].second].m_size = NodeSize(a_path[k + 1].first);
+        }
+    }
+    else
+    {
+        orphans.clear();
+        OrphanRec(old, orphans, removed);
+        DisconnectBranch(parent, index);
 
-            p.first = b.m_rect.m_max[0];
-            p.second = b.m_rect.m_max[1];
-            q.push_back(p);
-            current_mbrs.push_back(q);
+        Node* child = parent;
+        for (int k = (int)a_path.size() - 2; k >= 0; --k)
+        {
+            Node* ancestor = a_path[k].first;
+            int branch = a_path[k].second;
 
-            if (current_level > 0 && b.m_child != NULL) {
-                if (b.m_child->m_level == current_level - 1) {
-                    for (int j = 0; j < b.m_child->m_count; j++) {
-                        next_level_branches.push_back(b.m_child->m_branch[j]);
-                    }
-                }
+            if (child->m_count < MINNODES)
+            {
+                OrphanRec(child, orphans, removed);
+                DisconnectBranch(ancestor, branch);
+            }
+            else
+            {
+                ancestor->m_branch[branch].m_rect = NodeCover(child);
+                ancestor->m_branch[branch].m_size = NodeSize(child);
             }
+            child = ancestor;
         }
 
-        mbrs_n.push_back(current_mbrs);
+        if (m_root->IsInternalNode() && m_root->m_count == 0)
+        {
+            m_root->m_level = 0;
+        }
 
-        current_level_branches = next_level_branches;
-        current_level--;
+        BulkReInsert(orphans);
+
+        while (m_root->IsInternalNode() && m_root->m_count == 1)
+        {
+            Node* tempNode = m_root->m_branch[0].m_child;
+            FreeNode(m_root);
+            m_root = tempNode;
+        }
     }
-    return true;
-}
 
+    // Like every dead object, these leave mObjs at the next Condense; one
+    // pass over mObjs per repack would cost more than the repack.
+    for (unsigned int i = 0; i < removed.size(); ++i)
+    {
+        m_repackedDead.push_back(vector<pair<int, int>>());
+        m_repackedDead.back().swap(removed[i]);
+    }
+    ++m_version;
+
+    return (int)orphans.size() + (int)removed.size();
+}
 
 
-Rect RTree::MBR(vector<pair<int, int>> pol)
+// Sums the areas and the half-perimeters of every MBR inside the subtree
+// and counts the nodes below its root; a window query of side q visits
+// about area + q * margin + q * q * nodes of them (over the world's area).
+void RTree::SubtreeCost(Node* a_node, double& a_area, double& a_margin, int& a_nodes)
 {
-    int x1 = pol[0].first;
-    int x2 = pol[0].first;
-    int y1 = pol[0].second;
-    int y2 = pol[0].second;
-    if (pol.size() == 1) {
-        x1 -= 5; x2 += 5; y1 -= 5; y2 += 5;
+    if (a_node->IsInternalNode())
+    {
+        for (int index = 0; index < a_node->m_count; ++index)
+        {
+            Rect* rect = &a_node->m_branch[index].m_rect;
+            a_area += CalcRectArea(rect);
+            a_margin += (double)(rect->m_max[0] - rect->m_min[0]) + (rect->m_max[1] - rect->m_min[1]);
+            ++a_nodes;
+            SubtreeCost(a_node->m_branch[index].m_child, a_area, a_margin, a_nodes);
+        }
     }
-    else {
-        for (unsigned int i = 1; i < pol.size(); i++) {
-            if (pol[i].first < x1) {
-                x1 = pol[i].first;
-            }
-            if (x2 < pol[i].first) {
-                x2 = pol[i].first;
-            }
-            if (pol[i].second < y1) {
-                y1 = pol[i].second;
-            }
-            if (y2 < pol[i].second) {
-                y2 = pol[i].second;
-            }
+}
+
+
+// Builds a subtree of height a_level over a_entries[a_begin, a_end), which
+// are already in Hilbert order: as few children as full nodes below allow
+// (between MINNODES and MAXNODES), each taking an even, contiguous share.
+Node* RTree::PackRec(vector<Branch>& a_entries, int a_begin, int a_end, int a_level)
+{
+    Node* node = AllocNode();
+    node->m_level = a_level;
+
+    int total = a_end - a_begin;
+
+    if (a_level == 0)
+    {
+        for (int i = a_begin; i < a_end; ++i)
+        {
+            AddBranch(&a_entries[i], node, NULL);
         }
+        return node;
     }
 
-    return Rect(x1, y1, x2, y2);
+    // Packed full: every node left over is one more that queries visit
+    // (SubtreeCost counts them), and at MAXNODES 2 a three-quarter fill
+    // target rounds down to one entry per node.
+    long long capacity = 1;
+    for (int k = 0; k < a_level; ++k)
+    {
+        capacity *= MAXNODES;
+    }
+
+    int children = (int)Max((long long)MINNODES, (total + capacity - 1) / capacity);
+    children = Min(children, Min(total, MAXNODES));
+
+    for (int c = 0; c < children; ++c)
+    {
+        int begin = a_begin + (int)((long long)total * c / children);
+        int end = a_begin + (int)((long long)total * (c + 1) / children);
+
+        Branch branch;
+        branch.m_child = PackRec(a_entries, begin, end, a_level - 1);
+        branch.m_rect = NodeCover(branch.m_child);
+        branch.m_size = NodeSize(branch.m_child);
+        AddBranch(&branch, node, NULL);
+    }
+    return node;
 }
@@ -8,12 +8,17 @@
 
 #include <algorithm>
 #include <functional>
+#include <queue>
+#include <random>
+#include <set>
 #include <vector>
 #include <limits>
 #include <iostream>
 
 #define MAXNODES 2
 #define MINNODES 1
+#define REORG_DIRTY 64   // recently updated subtrees kept as auto-reorganize candidates
+#define JOIN_BUFFER 256   // pairs a DistanceJoin worker collects before taking the callback lock
 
 using namespace std;
 
@@ -39,6 +44,14 @@ struct Rect
     int m_max[2];
 };
 
+enum SearchMode
+{
+    SEARCH_INTERSECTS,
+    SEARCH_CONTAINS,
+    SEARCH_WITHIN,
+    SEARCH_EQUALS
+};
+
 struct Node;
 
 struct Branch
@@ -46,6 +59,10 @@ struct Branch
     Rect m_rect;
     Node* m_child;
     vector<pair<int, int>> m_data;
+    bool m_dead = false;
+    int m_size = 0;   // live objects below an internal branch
+    unsigned long long m_rasterTouched = 0;
+    unsigned long long m_rasterFull = 0;
 };
 
 struct Node
@@ -64,6 +81,30 @@ struct ListNode
     Node* m_node;
 };
 
+struct JoinState;   // DistanceJoin's per-task state, defined in RTree.cpp
+
+struct FilterStats
+{
+    int m_candidates;
+    int m_rasterRejected;
+    int m_rasterAccepted;
+    int m_exactTested;
+    int m_exactRejected;
+};
+
+struct MemoryStats
+{
+    size_t Total() const;
+
+    vector<size_t> m_nodeBytes;
+    size_t m_leafPayloadBytes;
+    size_t m_objectStoreBytes;
+    size_t m_unusedSlotBytes;
+    size_t m_slackBytes;
+    size_t m_pathCacheBytes;
+    size_t m_peakBytes;
+};
+
 struct PartitionVars
 {
     enum { NOT_TAKEN = -1 };
@@ -81,29 +122,80 @@ struct PartitionVars
     float m_coverSplitArea;
 };
 
+// A subtree as a reorganize pass found it: the root-to-parent path and the
+// node that path led to. It still names that subtree only while walking
+// m_path from the current root ends at m_node (RTree::SubtreeAt).
+struct SubtreeHandle
+{
+    vector<pair<Node*, int>> m_path;
+    Node* m_node;
+};
+
+
+class SearchCursor;
 
 class RTree
 {
+    friend class SearchCursor;
+
 public:
 
     RTree();
     RTree(const RTree& other);
     virtual ~RTree();
-    vector<vector<pair<int, int>>> mObjs;
+    vector<vector<pair<int, int>>> mObjs;   // under lazy deletion, dead objects stay here until Condense
 
     void Insert(const int a_min[2], const int a_max[2], vector<pair<int, int>>& a_dataId);
-    void Remove(const int a_min[2], const int a_max[2], const vector<pair<int, int>>& a_dataId);
+    void InsertBatch(vector<Branch>& a_branches);
+    void SetPathCache(bool a_enable);
+    bool Remove(const int a_min[2], const int a_max[2], const vector<pair<int, int>>& a_dataId);
     void RemoveAll();
+    int RemoveBatch(const vector<Rect>& a_rects, const vector<vector<pair<int, int>>>& a_dataIds);
+
+    void SetLazyDelete(bool a_lazy, int a_condenseThreshold);
+    void Condense();
+
+    int Reorganize(int a_budget);
+    void SetAutoReorganize(float a_threshold, int a_budget);
 
     bool Search(const Rect& a_rect, vector<vector<pair<int, int>>>& a_results);
+    bool Search(const Rect& a_rect, vector<vector<pair<int, int>>>& a_results, SearchMode a_mode);
+    SearchCursor SearchBegin(const Rect& a_rect);
+    bool Nearest(int a_x, int a_y, int a_k, vector<vector<pair<int, int>>>& a_results);
+
+    bool SegmentQuery(pair<int, int> a_p0, pair<int, int> a_p1, vector<vector<pair<int, int>>>& a_results, bool a_exact);
+    bool RayQuery(pair<int, int> a_origin, pair<double, double> a_dir, double a_maxT, int a_maxHits, vector<vector<pair<int, int>>>& a_results, bool a_exact);
+
+    bool SampleInWindow(const Rect& a_rect, int a_k, mt19937& a_rng, vector<vector<pair<int, int>>>& a_results);
+
+    int SearchMulti(const vector<Rect>& a_rects, const function<bool(int, const vector<pair<int, int>>&)>& a_callback);
+
+    bool ClosestPairs(RTree& a_other, int a_k, vector<pair<vector<pair<int, int>>, vector<pair<int, int>>>>& a_pairs);
+    int DistanceJoin(RTree& a_other, double a_distance, const function<bool(const vector<pair<int, int>>&, const vector<pair<int, int>>&)>& a_callback, int a_threads);
+
+    int SearchRadius(pair<int, int> a_center, double a_radius, const function<bool(const vector<pair<int, int>>&)>& a_callback, bool a_exact);
+
+    void SetRasterFilter(bool a_enable);
+    bool SearchExact(const Rect& a_rect, vector<vector<pair<int, int>>>& a_results, FilterStats* a_stats);
 
     vector<vector<pair<int, int>>> getObjects() const;
 
     int Count();
+    int Count(const Rect& a_rect);
+    bool Bounds(Rect& a_bounds);
+
+    MemoryStats MemoryUsage();
+    void TrackPeakMemory(bool a_enable);
 
     bool getMBRs(vector<vector<vector<pair<int, int>>>>& mbrs_n);
+    void getLeafBranches(vector<Branch>& a_branches);
     Rect MBR(vector<pair<int, int>> pol);
 
+    static unsigned long long HilbertValue(int a_x, int a_y);
+    static Rect CombineRect(const Rect* a_rectA, const Rect* a_rectB);
+    static float CalcRectArea(const Rect* a_rect);
+    static bool Overlap(const Rect* a_rectA, const Rect* a_rectB);
+
 
 protected:
 
@@ -114,13 +206,16 @@ protected:
 
     bool InsertRec(const Branch& a_branch, Node* a_node, Node** a_newNode, int a_level);
     bool InsertRect(const Branch& a_branch, Node** a_root, int a_level);
+    void SplitRoot(Node** a_root, Node* a_newNode);
+    int NodeSize(Node* a_node) const;
+    int BranchSize(const Branch* a_branch) const;
+    bool InsertCached(const Branch& a_branch);
+    void CachePath(const Rect* a_rect);
     Rect NodeCover(Node* a_node);
     bool AddBranch(const Branch* a_branch, Node* a_node, Node** a_newNode);
     void DisconnectBranch(Node* a_node, int a_index);
     int ChooseLeaf(const Rect* a_rect, Node* a_node);
-    Rect CombineRect(const Rect* a_rectA, const Rect* a_rectB);
     void SplitNode(Node* a_node, const Branch* a_branch, Node** a_newNode);
-    float CalcRectArea(Rect* a_rect);
     void GetBranches(Node* a_node, const Branch* a_branch, PartitionVars* a_parVars);
     void QuadraticSplit(PartitionVars* a_parVars, int a_minFill);
     void LoadNodes(Node* a_nodeA, Node* a_nodeB, PartitionVars* a_parVars);
@@ -132,20 +227,119 @@ protected:
     ListNode* AllocListNode();
     void FreeListNode(ListNode* a_listNode);
 
-    bool Overlap(const Rect* a_rectA, const Rect* a_rectB) const;
-    bool Overlap2(Rect* a_rectA, Rect* a_rectB) const;
+    bool Overlap2(const Rect* a_rectA, const Rect* a_rectB) const;
+    bool Equal(const Rect* a_rectA, const Rect* a_rectB) const;
 
     void ReInsert(Node* a_node, ListNode** a_listNode);
     void RemoveAllRec(Node* a_node);
     void Reset();
     void CountRec(Node* a_node, int& a_count);
+    void CountRec(Node* a_node, const Rect& a_rect, int& a_count);
 
     void CopyRec(Node* current, Node* other);
 
-    void SearchRec(Node* a_node, const Rect& a_rect, vector<vector<pair<int, int>>>& a_results);
+    void SearchRec(Node* a_node, const Rect& a_rect, vector<vector<pair<int, int>>>& a_results, SearchMode a_mode);
+    void LeafBranchesRec(Node* a_node, vector<Branch>& a_branches);
+
+    bool MarkDeadRec(const Rect* a_rect, const vector<pair<int, int>>& a_id, Node* a_node);
+    bool CondenseRec(Node* a_node, vector<Branch>& a_orphans, vector<vector<pair<int, int>>>& a_removed);
+    void OrphanRec(Node* a_node, vector<Branch>& a_orphans, vector<vector<pair<int, int>>>& a_removed);
+    void BulkReInsert(vector<Branch>& a_orphans);
+    size_t EraseObjects(vector<vector<pair<int, int>>>& a_objects, vector<vector<pair<int, int>>>& a_removed) const;
+    void DeadRec(Node* a_node, vector<vector<pair<int, int>>>& a_dead) const;
+
+    float NodeScore(Node* a_node);
+    int ReorgLevel(int a_budget) const;
+    void ScoreSubtreesRec(Node* a_node, int a_level, vector<pair<Node*, int>>& a_path, vector<pair<float, SubtreeHandle>>& a_candidates);
+    Node* SubtreeAt(const vector<pair<Node*, int>>& a_path) const;
+    void AutoReorganize();
+    int RepackSubtree(vector<pair<Node*, int>>& a_path);
+    void SubtreeCost(Node* a_node, double& a_area, double& a_margin, int& a_nodes);
+    Node* PackRec(vector<Branch>& a_entries, int a_begin, int a_end, int a_level);
+    void SortHilbert(vector<Branch>& a_branches);
+
+    void MemoryRec(Node* a_node, MemoryStats& a_stats);
+    void TrackBytes(long long a_delta);
+    void TrackPayload(long long a_delta);
+    size_t CurrentBytes() const;
+    size_t BranchBytes(const vector<Branch>& a_branches) const;
+    void ReleaseObjects(vector<vector<pair<int, int>>>& a_removed);
+    void ReportRec(Node* a_node, vector<vector<pair<int, int>>>& a_results);
+    double MinDist(const Rect* a_rect, int a_x, int a_y) const;
+    double MaxDist(const Rect* a_rect, int a_x, int a_y) const;
+    double GeometryDist(const vector<pair<int, int>>& a_pol, int a_x, int a_y) const;
+    void SampleRec(Node* a_node, const Rect& a_rect, vector<pair<const Branch*, long long>>& a_pieces);
+    bool MultiRec(Node* a_node, const Rect* a_rects, int a_first, unsigned long long a_mask, const Rect& a_cover, const function<bool(int, const vector<pair<int, int>>&)>& a_callback, int& a_count);
+    bool JoinRec(Node* a_nodeA, Node* a_nodeB, JoinState& a_state);
+    bool JoinReport(const vector<pair<int, int>>* a_objA, const vector<pair<int, int>>* a_objB, JoinState& a_state);
+    bool JoinFlush(JoinState& a_state);
+    void ObjectsRec(Node* a_node, vector<const vector<pair<int, int>>*>& a_objects);
+    double RectDist(const Rect* a_rectA, const Rect* a_rectB) const;
+    double RectMaxDist(const Rect* a_rectA, const Rect* a_rectB) const;
+    double RectMinMaxDist(const Rect* a_rectA, const Rect* a_rectB) const;
+    bool RadiusRec(Node* a_node, int a_x, int a_y, double a_radius2, const function<bool(const vector<pair<int, int>>&)>& a_callback, bool a_exact, bool a_inside, int& a_count);
+
+    bool RaySlab(const Rect* a_rect, const double a_origin[2], const double a_dir[2], double a_maxT, double* a_tEnter) const;
+    bool RayGeometry(const vector<pair<int, int>>& a_pol, const double a_origin[2], const double a_dir[2], double a_maxT, double* a_tEnter) const;
+    bool RaySegment(pair<int, int> a_a, pair<int, int> a_b, const double a_origin[2], const double a_dir[2], double* a_t) const;
+
+    void SearchExactRec(Node* a_node, const Rect& a_rect, vector<vector<pair<int, int>>>& a_results, FilterStats& a_stats);
+    void BuildRaster(Branch* a_branch) const;
+    int RasterTest(const Branch* a_branch, const Rect* a_rect) const;
+    Rect RasterCell(const Rect* a_mbr, int a_col, int a_row) const;
+    unsigned int RasterSpan(int a_min, int a_max, int a_low, int a_high) const;
+    bool GeometryIntersects(const vector<pair<int, int>>& a_pol, const Rect* a_rect) const;
+    bool PointInPolygon(const vector<pair<int, int>>& a_pol, double a_x, double a_y) const;
+    bool SegmentIntersectsRect(pair<int, int> a_p0, pair<int, int> a_p1, const Rect* a_rect) const;
 
     Node* m_root;
     float m_unitSphereVolume;
+    unsigned long m_version;
+
+    bool m_lazyDelete;
+    int m_condenseThreshold;
+    int m_deadCount;
+    vector<vector<pair<int, int>>> m_repackedDead;   // dead objects a repack took out of the leaves, counted in m_deadCount
+
+    size_t m_allocBytes;
+    size_t m_payloadBytes;
+    size_t m_peakBytes;
+    bool m_trackPeak;
+
+    bool m_rasterFilter;
+
+    float m_reorgThreshold;
+    int m_autoReorgBudget;
+    int m_reorgCredit;
+    vector<SubtreeHandle> m_reorgDirty;
+    bool m_tracePath;
+    vector<pair<Node*, int>> m_updatePath;   // root-first path of the last Insert or Remove, while m_tracePath
+
+    bool m_pathCache;
+    unsigned long m_pathVersion;
+    vector<pair<Node*, int>> m_insertPath;
+};
+
+
+// Window query that hands out its hits a page at a time. The traversal
+// stack is kept between calls; any Insert/Remove on the tree after the
+// cursor was created makes it STALE.
+class SearchCursor
+{
+public:
+
+    enum Status { MORE, DONE, STALE };
+
+    SearchCursor(RTree& a_tree, const Rect& a_rect);
+
+    Status Next(int a_max, vector<vector<pair<int, int>>>& a_results);
+
+protected:
+
+    RTree* m_tree;
+    Rect m_rect;
+    unsigned long m_version;
+    vector<pair<Node*, int>> m_stack;
 };
 
 #endif
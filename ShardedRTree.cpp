@@ -0,0 +1,433 @@
+#include "ShardedRTree.h"
+
+ShardedRTree::ShardedRTree(const Rect& a_bounds, int a_cols, int a_rows)
+{
+    m_cols = Max(a_cols, 1);
+    m_rows = Max(a_rows, 1);
+
+    m_autoSkew = 0;
+    m_inserted = 0;
+    m_rebalanceAt = SHARD_REBALANCE_INTERVAL;
+
+    m_pathCache = false;
+    m_lazyDelete = false;
+    m_condenseThreshold = 0;
+    m_reorgThreshold = 0;
+    m_reorgBudget = 0;
+
+    GridSplits(a_bounds, 0, m_cols, 0, m_rows);
+
+    for (int index = 0; index < m_cols * m_rows; ++index)
+    {
+        m_shards.push_back(NewShard());
+    }
+}
+
+
+ShardedRTree::~ShardedRTree()
+{
+    for (unsigned int i = 0; i < m_shards.size(); ++i)
+    {
+        delete m_shards[i];
+    }
+}
+
+
+// Builds the a_cols x a_rows grid as splits: halve the column range first,
+// then the row range, cutting at the same even positions as a plain grid.
+int ShardedRTree::GridSplits(const Rect& a_bounds, int a_colFirst, int a_colEnd, int a_rowFirst, int a_rowEnd)
+{
+    if (a_colEnd - a_colFirst == 1 && a_rowEnd - a_rowFirst == 1)
+    {
+        return ~(a_rowFirst * m_cols + a_colFirst);
+    }
+
+    int index = (int)m_splits.size();
+    m_splits.push_back(ShardSplit());
+
+    ShardSplit split;
+    if (a_colEnd - a_colFirst > 1)
+    {
+        int mid = (a_colFirst + a_colEnd) / 2;
+        long long width = (long long)a_bounds.m_max[0] - a_bounds.m_min[0];
+        split.m_axis = 0;
+        split.m_value = (int)(a_bounds.m_min[0] + width * mid / m_cols);
+        split.m_below = GridSplits(a_bounds, a_colFirst, mid, a_rowFirst, a_rowEnd);
+        split.m_above = GridSplits(a_bounds, mid, a_colEnd, a_rowFirst, a_rowEnd);
+    }
+    else
+    {
+        int mid = (a_rowFirst + a_rowEnd) / 2;
+        long long height = (long long)a_bounds.m_max[1] - a_bounds.m_min[1];
+        split.m_axis = 1;
+        split.m_value = (int)(a_bounds.m_min[1] + height * mid / m_rows);
+        split.m_below = GridSplits(a_bounds, a_colFirst, a_colEnd, a_rowFirst, mid);
+        split.m_above = GridSplits(a_bounds, a_colFirst, a_colEnd, mid, a_rowEnd);
+    }
+    m_splits[index] = split;
+    return index;
+}
+
+
+// KD partition of a_centers[a_begin, a_end) into a_shardCount shards: cut
+// across the longer extent so each side gets centers in proportion to its
+// shards. Works for correlated data (a diagonal, say) where independent x
+// and y quantiles leave most grid cells empty.
+int ShardedRTree::MedianSplits(vector<pair<int, int>>& a_centers, int a_begin, int a_end, int a_shardFirst, int a_shardCount, vector<ShardSplit>& a_splits)
+{
+    if (a_shardCount == 1)
+    {
+        return ~a_shardFirst;
+    }
+
+    int minX = numeric_limits<int>::max(), maxX = numeric_limits<int>::min();
+    int minY = minX, maxY = maxX;
+    for (int i = a_begin; i < a_end; ++i)
+    {
+        minX = Min(minX, a_centers[i].first);
+        maxX = Max(maxX, a_centers[i].first);
+        minY = Min(minY, a_centers[i].second);
+        maxY = Max(maxY, a_centers[i].second);
+    }
+
+    ShardSplit split;
+    split.m_axis = ((long long)maxX - minX >= (long long)maxY - minY) ? 0 : 1;
+    auto coord = [&split](const pair<int, int>& a_center) { return split.m_axis == 0 ? a_center.first : a_center.second; };
+
+    int belowShards = a_shardCount / 2;
+    int cut = a_begin + (int)((long long)(a_end - a_begin) * belowShards / a_shardCount);
+    split.m_value = numeric_limits<int>::max();
+    if (cut < a_end)
+    {
+        nth_element(a_centers.begin() + a_begin, a_centers.begin() + cut, a_centers.begin() + a_end,
+            [&coord](const pair<int, int>& a_a, const pair<int, int>& a_b) { return coord(a_a) < coord(a_b); });
+        split.m_value = coord(a_centers[cut]);
+    }
+
+    // Centers equal to the cut value route above, so that is where they go.
+    int mid = (int)(partition(a_centers.begin() + a_begin, a_centers.begin() + a_end,
+        [&coord, &split](const pair<int, int>& a_center) { return coord(a_center) < split.m_value; }) - a_centers.begin());
+
+    int index = (int)a_splits.size();
+    a_splits.push_back(ShardSplit());
+    split.m_below = MedianSplits(a_centers, a_begin, mid, a_shardFirst, belowShards, a_splits);
+    split.m_above = MedianSplits(a_centers, mid, a_end, a_shardFirst + belowShards, a_shardCount - belowShards, a_splits);
+    a_splits[index] = split;
+    return index;
+}
+
+
+int ShardedRTree::ShardIndex(const int a_min[2], const int a_max[2]) const
+{
+    int cx = (int)(((long long)a_min[0] + a_max[0]) / 2);
+    int cy = (int)(((long long)a_min[1] + a_max[1]) / 2);
+
+    return ShardIndex(m_splits, cx, cy);
+}
+
+
+int ShardedRTree::ShardIndex(const vector<ShardSplit>& a_splits, int a_x, int a_y) const
+{
+    int node = a_splits.empty() ? ~0 : 0;
+    while (node >= 0)
+    {
+        const ShardSplit& split = a_splits[node];
+        node = (split.m_axis == 0 ? a_x : a_y) < split.m_value ? split.m_below : split.m_above;
+    }
+    return ~node;
+}
+
+
+// An empty shard whose tree carries the settings given to this index.
+Shard* ShardedRTree::NewShard()
+{
+    Shard* shard = new Shard;
+    shard->m_empty = true;
+    shard->m_size = 0;
+
+    shard->m_tree.SetPathCache(m_pathCache);
+    shard->m_tree.SetLazyDelete(m_lazyDelete, m_condenseThreshold);
+    shard->m_tree.SetAutoReorganize(m_reorgThreshold, m_reorgBudget);
+    return shard;
+}
+
+
+void ShardedRTree::InsertShard(Shard* a_shard, const Branch& a_branch)
+{
+    vector<pair<int, int>> data = a_branch.m_data;
+    a_shard->m_tree.Insert(a_branch.m_rect.m_min, a_branch.m_rect.m_max, data);
+
+    if (a_shard->m_empty)
+    {
+        a_shard->m_cover = a_branch.m_rect;
+        a_shard->m_empty = false;
+    }
+    else
+    {
+        for (int axis = 0; axis < 2; ++axis)
+        {
+            a_shard->m_cover.m_min[axis] = Min(a_shard->m_cover.m_min[axis], a_branch.m_rect.m_min[axis]);
+            a_shard->m_cover.m_max[axis] = Max(a_shard->m_cover.m_max[axis], a_branch.m_rect.m_max[axis]);
+        }
+    }
+    ++a_shard->m_size;
+}
+
+
+void ShardedRTree::Insert(const int a_min[2], const int a_max[2], vector<pair<int, int>>& a_dataId)
+{
+    bool check;
+    float skew;
+    {
+        shared_lock<shared_mutex> layout(m_layoutMutex);
+
+        Branch branch;
+        branch.m_rect = Rect(a_min[0], a_min[1], a_max[0], a_max[1]);
+        branch.m_child = NULL;
+        branch.m_data = a_dataId;
+
+        Shard* shard = m_shards[ShardIndex(a_min, a_max)];
+        {
+            lock_guard<mutex> lock(shard->m_mutex);
+            InsertShard(shard, branch);
+        }
+
+        skew = m_autoSkew;
+        check = (++m_inserted == m_rebalanceAt);
+    }
+
+    if (check && skew > 0)
+    {
+        Rebalance(skew);
+    }
+}
+
+
+// Objects are bucketed by shard first so every shard is filled by exactly
+// one thread and the shard locks are never contended.
+void ShardedRTree::InsertParallel(vector<vector<pair<int, int>>>& a_objs, int a_threads)
+{
+    float skew;
+    {
+        shared_lock<shared_mutex> layout(m_layoutMutex);
+
+        vector<vector<Branch>> buckets(m_shards.size());
+        for (unsigned int i = 0; i < a_objs.size(); ++i)
+        {
+            Branch branch;
+            branch.m_rect = m_shards[0]->m_tree.MBR(a_objs[i]);
+            branch.m_child = NULL;
+            branch.m_data = a_objs[i];
+            buckets[ShardIndex(branch.m_rect.m_min, branch.m_rect.m_max)].push_back(branch);
+        }
+
+        atomic<int> next(0);
+        auto worker = [&]()
+        {
+            for (int index = next++; index < (int)m_shards.size(); index = next++)
+            {
+                lock_guard<mutex> lock(m_shards[index]->m_mutex);
+                for (unsigned int i = 0; i < buckets[index].size(); ++i)
+                {
+                    InsertShard(m_shards[index], buckets[index][i]);
+                }
+            }
+        };
+
+        vector<thread> threads;
+        for (int t = 1; t < a_threads; ++t)
+        {
+            threads.push_back(thread(worker));
+        }
+        worker();
+        for (unsigned int t = 0; t < threads.size(); ++t)
+        {
+            threads[t].join();
+        }
+
+        skew = m_autoSkew;
+    }
+
+    if (skew > 0)
+    {
+        Rebalance(skew);
+    }
+}
+
+
+bool ShardedRTree::Remove(const int a_min[2], const int a_max[2], const vector<pair<int, int>>& a_dataId)
+{
+    shared_lock<shared_mutex> layout(m_layoutMutex);
+
+    Shard* shard = m_shards[ShardIndex(a_min, a_max)];
+    lock_guard<mutex> lock(shard->m_mutex);
+
+    if (!shard->m_tree.Remove(a_min, a_max, a_dataId))
+    {
+        return false;
+    }
+
+    --shard->m_size;
+    shard->m_empty = (shard->m_size == 0 || !shard->m_tree.Bounds(shard->m_cover));
+    return true;
+}
+
+
+bool ShardedRTree::Search(const Rect& a_rect, vector<vector<pair<int, int>>>& a_results)
+{
+    shared_lock<shared_mutex> layout(m_layoutMutex);
+
+    a_results.clear();
+    vector<vector<pair<int, int>>> shardResults;
+
+    for (unsigned int i = 0; i < m_shards.size(); ++i)
+    {
+        Shard* shard = m_shards[i];
+        lock_guard<mutex> lock(shard->m_mutex);
+
+        if (shard->m_empty ||
+            shard->m_cover.m_min[0] > a_rect.m_max[0] || a_rect.m_min[0] > shard->m_cover.m_max[0] ||
+            shard->m_cover.m_min[1] > a_rect.m_max[1] || a_rect.m_min[1] > shard->m_cover.m_max[1])
+        {
+            continue;
+        }
+
+        shard->m_tree.Search(a_rect, shardResults);
+        a_results.insert(a_results.end(), shardResults.begin(), shardResults.end());
+    }
+    return !a_results.empty();
+}
+
+
+int ShardedRTree::Count()
+{
+    shared_lock<shared_mutex> layout(m_layoutMutex);
+
+    int count = 0;
+    for (unsigned int i = 0; i < m_shards.size(); ++i)
+    {
+        lock_guard<mutex> lock(m_shards[i]->m_mutex);
+        count += m_shards[i]->m_size;
+    }
+    return count;
+}
+
+
+int ShardedRTree::ShardCount() const
+{
+    return (int)m_shards.size();
+}
+
+
+// When the largest shard holds more than a_skew times the mean, the stored
+// MBR centers are split KD-style into equal groups and every shard rebuilt.
+// Returns false, keeping the layout, if that would not shrink the largest
+// shard (many identical centers, say), so repeated calls settle.
+bool ShardedRTree::Rebalance(float a_skew)
+{
+    unique_lock<shared_mutex> layout(m_layoutMutex);
+
+    int total = 0, largest = 0;
+    for (unsigned int i = 0; i < m_shards.size(); ++i)
+    {
+        total += m_shards[i]->m_size;
+        largest = Max(largest, m_shards[i]->m_size);
+    }
+    m_inserted = 0;
+    m_rebalanceAt = Max(SHARD_REBALANCE_INTERVAL, total);
+
+    if (total == 0 || largest <= a_skew * total / (float)m_shards.size())
+    {
+        return false;
+    }
+
+    vector<Branch> all, branches;
+    for (unsigned int i = 0; i < m_shards.size(); ++i)
+    {
+        m_shards[i]->m_tree.getLeafBranches(branches);
+        all.insert(all.end(), branches.begin(), branches.end());
+    }
+
+    vector<pair<int, int>> centers;
+    for (unsigned int i = 0; i < all.size(); ++i)
+    {
+        centers.push_back(make_pair((int)(((long long)all[i].m_rect.m_min[0] + all[i].m_rect.m_max[0]) / 2),
+            (int)(((long long)all[i].m_rect.m_min[1] + all[i].m_rect.m_max[1]) / 2)));
+    }
+
+    vector<ShardSplit> splits;
+    MedianSplits(centers, 0, (int)centers.size(), 0, (int)m_shards.size(), splits);
+
+    vector<int> sizes(m_shards.size(), 0);
+    int newLargest = 0;
+    for (unsigned int i = 0; i < centers.size(); ++i)
+    {
+        newLargest = Max(newLargest, ++sizes[ShardIndex(splits, centers[i].first, centers[i].second)]);
+    }
+    if (newLargest >= largest)
+    {
+        return false;
+    }
+
+    m_splits.swap(splits);
+    for (unsigned int i = 0; i < m_shards.size(); ++i)
+    {
+        delete m_shards[i];
+        m_shards[i] = NewShard();
+    }
+
+    for (unsigned int i = 0; i < all.size(); ++i)
+    {
+        InsertShard(m_shards[ShardIndex(all[i].m_rect.m_min, all[i].m_rect.m_max)], all[i]);
+    }
+    return true;
+}
+
+
+// With a_skew > 0, InsertParallel ends with Rebalance(a_skew), and Insert
+// calls it once the inserts since the last check reach the number stored
+// then (at least SHARD_REBALANCE_INTERVAL), so the check stays O(1) per
+// insert amortized. 0 turns it off.
+void ShardedRTree::SetAutoRebalance(float a_skew)
+{
+    unique_lock<shared_mutex> layout(m_layoutMutex);
+    m_autoSkew = a_skew;
+}
+
+
+void ShardedRTree::SetPathCache(bool a_enable)
+{
+    unique_lock<shared_mutex> layout(m_layoutMutex);
+
+    m_pathCache = a_enable;
+    for (unsigned int i = 0; i < m_shards.size(); ++i)
+    {
+        m_shards[i]->m_tree.SetPathCache(a_enable);
+    }
+}
+
+
+void ShardedRTree::SetLazyDelete(bool a_lazy, int a_condenseThreshold)
+{
+    unique_lock<shared_mutex> layout(m_layoutMutex);
+
+    m_lazyDelete = a_lazy;
+    m_condenseThreshold = a_condenseThreshold;
+    for (unsigned int i = 0; i < m_shards.size(); ++i)
+    {
+        m_shards[i]->m_tree.SetLazyDelete(a_lazy, a_condenseThreshold);
+    }
+}
+
+
+void ShardedRTree::SetAutoReorganize(float a_threshold, int a_budget)
+{
+    unique_lock<shared_mutex> layout(m_layoutMutex);
+
+    m_reorgThreshold = a_threshold;
+    m_reorgBudget = a_budget;
+    for (unsigned int i = 0; i < m_shards.size(); ++i)
+    {
+        m_shards[i]->m_tree.SetAutoReorganize(a_threshold, a_budget);
+    }
+}
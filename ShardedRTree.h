@@ -0,0 +1,95 @@
+#ifndef SHARDEDRTREE_H
+#define SHARDEDRTREE_H
+
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+
+#include "RTree.h"
+
+#define SHARD_REBALANCE_INTERVAL 4096   // fewest inserts between automatic skew checks
+
+
+struct Shard
+{
+    RTree m_tree;
+    mutex m_mutex;
+    Rect m_cover;
+    bool m_empty;
+    int m_size;
+};
+
+// One cut of the shard layout: centers below m_value on m_axis go to
+// m_below, the rest to m_above. A child index >= 0 is another split, a
+// negative one is ~shard.
+struct ShardSplit
+{
+    int m_axis;
+    int m_value;
+    int m_below;
+    int m_above;
+};
+
+
+// Space is cut into a_cols x a_rows cells, each backed by its own RTree.
+// An object goes to the cell holding the center of its MBR; a query visits
+// only the shards whose cover (the union of what they hold) overlaps it.
+// Rebalance re-cuts space KD-style at the median of the stored centers, so
+// the cells need not stay a grid. Callers either call it themselves or set
+// SetAutoRebalance, after which inserts check the skew as they go. The tree
+// settings below apply to every shard, including the ones Rebalance rebuilds.
+class ShardedRTree
+{
+public:
+
+    ShardedRTree(const Rect& a_bounds, int a_cols, int a_rows);
+    ShardedRTree(const ShardedRTree& other) = delete;
+    virtual ~ShardedRTree();
+
+    ShardedRTree& operator=(const ShardedRTree& other) = delete;
+
+    void Insert(const int a_min[2], const int a_max[2], vector<pair<int, int>>& a_dataId);
+    void InsertParallel(vector<vector<pair<int, int>>>& a_objs, int a_threads);
+    bool Remove(const int a_min[2], const int a_max[2], const vector<pair<int, int>>& a_dataId);
+
+    bool Search(const Rect& a_rect, vector<vector<pair<int, int>>>& a_results);
+
+    int Count();
+    int ShardCount() const;
+
+    bool Rebalance(float a_skew);
+    void SetAutoRebalance(float a_skew);
+
+    void SetPathCache(bool a_enable);
+    void SetLazyDelete(bool a_lazy, int a_condenseThreshold);
+    void SetAutoReorganize(float a_threshold, int a_budget);
+
+
+protected:
+
+    int ShardIndex(const int a_min[2], const int a_max[2]) const;
+    int ShardIndex(const vector<ShardSplit>& a_splits, int a_x, int a_y) const;
+    Shard* NewShard();
+    void InsertShard(Shard* a_shard, const Branch& a_branch);
+    int GridSplits(const Rect& a_bounds, int a_colFirst, int a_colEnd, int a_rowFirst, int a_rowEnd);
+    int MedianSplits(vector<pair<int, int>>& a_centers, int a_begin, int a_end, int a_shardFirst, int a_shardCount, vector<ShardSplit>& a_splits);
+
+    int m_cols;
+    int m_rows;
+    vector<ShardSplit> m_splits;
+    vector<Shard*> m_shards;
+    shared_mutex m_layoutMutex;
+
+    float m_autoSkew;
+    atomic<int> m_inserted;
+    int m_rebalanceAt;
+
+    bool m_pathCache;
+    bool m_lazyDelete;
+    int m_condenseThreshold;
+    float m_reorgThreshold;
+    int m_reorgBudget;
+};
+
+#endif
@@ -0,0 +1,379 @@
+#include <unistd.h>
+
+#include <chrono>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+#include <iostream>
+#include "RTree.h"
+#include "BufferedRTree.h"
+#include "HilbertRTree.h"
+#include "PagedRTree.h"
+#include "PointRTree.h"
+#include "PolygonReader.h"
+#include "ShardedRTree.h"
+
+using namespace std;
+
+double elapsed_ms(chrono::steady_clock::time_point start) {
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+vector<vector<pair<int, int>>> random_boxes(int n, int world, int maxSide, unsigned int seed) {
+    mt19937 rng(seed);
+    vector<vector<pair<int, int>>> objs;
+    objs.reserve(n);
+    for (int i = 0; i < n; ++i) {
+        int x = rng() % world;
+        int y = rng() % world;
+        int w = rng() % maxSide + 1;
+        int h = rng() % maxSide + 1;
+        objs.push_back({ {x, y}, {x + w, y + h} });
+    }
+    return objs;
+}
+
+// Objects emitted track by track, each a small box a short random step from
+// the previous one, the way sensor feeds arrive.
+vector<vector<pair<int, int>>> trajectory_boxes(int n, int trackLength, unsigned int seed) {
+    mt19937 rng(seed);
+    vector<vector<pair<int, int>>> objs;
+    objs.reserve(n);
+    int x = 0, y = 0;
+    for (int i = 0; i < n; ++i) {
+        if (i % trackLength == 0) {
+            x = rng() % 100000;
+            y = rng() % 100000;
+        }
+        x += (int)(rng() % 21) - 10;
+        y += (int)(rng() % 21) - 10;
+        objs.push_back({ {x, y}, {x + 3, y + 3} });
+    }
+    return objs;
+}
+
+// The same points indexed as one-vertex polygons in RTree (padded MBR and a
+// vertex vector per leaf entry) and as packed PointRTree leaf entries.
+void bench_point_memory(int n) {
+    mt19937 rng(7);
+    RTree boxes;
+    PointRTree points;
+    for (int i = 0; i < n; ++i) {
+        int x = rng() % 100000;
+        int y = rng() % 100000;
+        vector<pair<int, int>> obj = { {x, y} };
+        Rect rect = boxes.MBR(obj);
+        boxes.Insert(rect.m_min, rect.m_max, obj);
+        points.Insert(x, y, i);
+    }
+
+    cout << "--- POINT MEMORY (" << n << " points, 20000 windows) ---" << endl;
+    for (int tree = 0; tree < 2; ++tree) {
+        MemoryStats stats = tree == 0 ? boxes.MemoryUsage() : points.MemoryUsage();
+        size_t leafBytes = stats.m_nodeBytes[0] + stats.m_leafPayloadBytes;
+
+        mt19937 windows(8);
+        vector<vector<pair<int, int>>> boxHits;
+        vector<PointEntry> pointHits;
+        long long hits = 0;
+        auto start = chrono::steady_clock::now();
+        for (int q = 0; q < 20000; ++q) {
+            int x = windows() % 100000;
+            int y = windows() % 100000;
+            Rect window(x, y, x + 1000, y + 1000);
+            if (tree == 0) {
+                boxes.Search(window, boxHits);
+                hits += boxHits.size();
+            } else {
+                points.Search(window, pointHits);
+                hits += pointHits.size();
+            }
+        }
+        double ms = elapsed_ms(start);
+
+        cout << (tree == 0 ? "RTree:      " : "PointRTree: ") << stats.Total() / (1 << 20) << " MB total, "
+             << leafBytes / (1 << 20) << " MB in leaves, " << stats.m_nodeBytes.size() << " levels, "
+             << (double)stats.Total() / n << " bytes/point, " << ms << " ms for " << hits << " hits" << endl;
+    }
+}
+
+// Node utilization (used m_branch slots over MAXNODES per node) and window
+// query cost after the same insert-only load into RTree and HilbertRTree.
+void bench_hilbert(int n) {
+    vector<vector<pair<int, int>>> objs = random_boxes(n, 100000, 50, 9);
+    RTree guttman;
+    HilbertRTree hilbert;
+    for (auto& obj : objs) {
+        Rect rect = guttman.MBR(obj);
+        guttman.Insert(rect.m_min, rect.m_max, obj);
+        hilbert.Insert(rect.m_min, rect.m_max, obj);
+    }
+
+    MemoryStats stats = guttman.MemoryUsage();
+    size_t nodes = 0;
+    for (size_t bytes : stats.m_nodeBytes) {
+        nodes += bytes / sizeof(Node);
+    }
+    size_t used = nodes * (MAXNODES + 1) - stats.m_unusedSlotBytes / sizeof(Branch);
+
+    cout << "--- HILBERT R-TREE (" << n << " objects, 20000 windows) ---" << endl;
+    for (int tree = 0; tree < 2; ++tree) {
+        mt19937 windows(10);
+        vector<vector<pair<int, int>>> results;
+        long long hits = 0;
+        auto start = chrono::steady_clock::now();
+        for (int q = 0; q < 20000; ++q) {
+            int x = windows() % 100000;
+            int y = windows() % 100000;
+            Rect window(x, y, x + 1000, y + 1000);
+            if (tree == 0) {
+                guttman.Search(window, results);
+            } else {
+                hilbert.Search(window, results);
+            }
+            hits += results.size();
+        }
+        double ms = elapsed_ms(start);
+
+        float utilization = tree == 0 ? (float)used / ((float)nodes * MAXNODES) : hilbert.Utilization();
+        cout << (tree == 0 ? "RTree:        " : "HilbertRTree: ") << (int)(utilization * 100) << "% node utilization, "
+             << ms << " ms for " << hits << " hits" << endl;
+    }
+}
+
+void bench_sharded_ingest(int n) {
+    vector<vector<pair<int, int>>> objs = random_boxes(n, 100000, 50, 1);
+
+    cout << "--- SHARDED INGEST (" << n << " objects) ---" << endl;
+    for (int threads = 1; threads <= (int)thread::hardware_concurrency() * 2 && threads <= 64; threads *= 2) {
+        ShardedRTree index(Rect(0, 0, 100000, 100000), 8, 8);
+        auto start = chrono::steady_clock::now();
+        index.InsertParallel(objs, threads);
+        double ms = elapsed_ms(start);
+        cout << "threads " << threads << ": " << ms << " ms, "
+             << (long long)(n / (ms / 1000.0)) << " objects/s" << endl;
+    }
+}
+
+void bench_buffered_ingest(int n) {
+    vector<vector<pair<int, int>>> objs = random_boxes(n, 100000, 50, 2);
+
+    cout << "--- BUFFERED INGEST (" << n << " objects) ---" << endl;
+    {
+        RTree tree;
+        auto start = chrono::steady_clock::now();
+        for (auto& obj : objs) {
+            Rect rect = tree.MBR(obj);
+            tree.Insert(rect.m_min, rect.m_max, obj);
+        }
+        double ms = elapsed_ms(start);
+        cout << "direct: " << (long long)(n / (ms / 1000.0)) << " objects/s" << endl;
+    }
+    for (int batch : { 64, 512, 4096 }) {
+        BufferedRTree tree;
+        RTree shape;
+        tree.SetFlushPolicy(batch, -1);
+        auto start = chrono::steady_clock::now();
+        for (auto& obj : objs) {
+            Rect rect = shape.MBR(obj);
+            tree.Insert(rect.m_min, rect.m_max, obj);
+        }
+        tree.Flush();
+        double ms = elapsed_ms(start);
+        cout << "buffer " << batch << ": " << (long long)(n / (ms / 1000.0)) << " objects/s" << endl;
+    }
+}
+
+void bench_path_cache(int n) {
+    vector<vector<pair<int, int>>> objs = trajectory_boxes(n, 500, 5);
+
+    cout << "--- TRAJECTORY INGEST (" << n << " objects, tracks of 500) ---" << endl;
+    for (bool cached : { false, true }) {
+        RTree tree;
+        tree.SetPathCache(cached);
+        auto start = chrono::steady_clock::now();
+        for (auto& obj : objs) {
+            Rect rect = tree.MBR(obj);
+            tree.Insert(rect.m_min, rect.m_max, obj);
+        }
+        double ms = elapsed_ms(start);
+        cout << (cached ? "path cache: " : "from root: ") << (long long)(n / (ms / 1000.0)) << " objects/s" << endl;
+    }
+}
+
+// Objects drifting a short way on each update (remove, then insert at the
+// new spot) under lazy deletion, so the dead entries stay in the tree. Window
+// query time on the fresh tree, then after the same churn without and with
+// SetAutoReorganize repacking the subtrees the updates pass through.
+void bench_reorganize(int n) {
+    cout << "--- CHURN (" << n << " objects, " << 2 * n << " moves, lazy delete, 20000 windows) ---" << endl;
+    for (int pass = 0; pass < 3; ++pass) {
+        vector<vector<pair<int, int>>> objs = random_boxes(n, 100000, 50, 11);
+        RTree tree;
+        for (auto& obj : objs) {
+            Rect rect = tree.MBR(obj);
+            tree.Insert(rect.m_min, rect.m_max, obj);
+        }
+
+        double churnMs = 0;
+        if (pass > 0) {
+            tree.SetLazyDelete(true, 4 * n);
+            if (pass == 2) {
+                tree.SetAutoReorganize(0, 16);
+            }
+
+            mt19937 rng(12);
+            auto start = chrono::steady_clock::now();
+            for (int i = 0; i < 2 * n; ++i) {
+                vector<pair<int, int>>& obj = objs[rng() % n];
+                Rect rect = tree.MBR(obj);
+                tree.Remove(rect.m_min, rect.m_max, obj);
+
+                int dx = (int)(rng() % 2001) - 1000;
+                int dy = (int)(rng() % 2001) - 1000;
+                for (auto& p : obj) {
+                    p.first += dx;
+                    p.second += dy;
+                }
+                rect = tree.MBR(obj);
+                tree.Insert(rect.m_min, rect.m_max, obj);
+            }
+            churnMs = elapsed_ms(start);
+        }
+
+        // Best of three runs over the same windows.
+        double ms = 0;
+        long long hits = 0;
+        for (int run = 0; run < 3; ++run) {
+            mt19937 windows(13);
+            vector<vector<pair<int, int>>> results;
+            hits = 0;
+            auto start = chrono::steady_clock::now();
+            for (int q = 0; q < 20000; ++q) {
+                int x = windows() % 100000;
+                int y = windows() % 100000;
+                tree.Search(Rect(x, y, x + 1000, y + 1000), results);
+                hits += results.size();
+            }
+            ms = run == 0 ? elapsed_ms(start) : min(ms, elapsed_ms(start));
+        }
+
+        const char* name = pass == 0 ? "fresh:        " : pass == 1 ? "churned:      " : "auto-reorg:   ";
+        cout << name << ms << " ms for " << hits << " hits";
+        if (pass > 0) {
+            cout << " (churn " << churnMs << " ms)";
+        }
+        cout << endl;
+    }
+}
+
+void bench_paged_faults(int n) {
+    const string path = "bench_paged.idx";
+    unlink(path.c_str());
+    unlink((path + ".dat").c_str());
+
+    vector<vector<pair<int, int>>> objs = random_boxes(n, 100000, 50, 3);
+    {
+        PagedRTree tree(path, 1024);
+        RTree shape;
+        for (auto& obj : objs) {
+            Rect rect = shape.MBR(obj);
+            if (!tree.Insert(rect.m_min, rect.m_max, obj)) {
+                cout << "paged index: I/O error on " << path << endl;
+                return;
+            }
+        }
+    }
+
+    cout << "--- PAGED QUERIES (" << n << " objects, 1000 windows) ---" << endl;
+    for (int frames : { 8, 32, 128, 512, 2048 }) {
+        PagedRTree tree(path, frames);
+        mt19937 rng(4);
+        vector<vector<pair<int, int>>> results;
+        tree.Pool().ResetStats();
+        for (int q = 0; q < 1000; ++q) {
+            int x = rng() % 100000;
+            int y = rng() % 100000;
+            tree.Search(Rect(x, y, x + 2000, y + 2000), results);
+        }
+        cout << "pool " << frames << " frames: " << tree.Pool().Faults() / 1000.0 << " page faults/query" << endl;
+    }
+
+    unlink(path.c_str());
+    unlink((path + ".dat").c_str());
+}
+
+// Writes n polygons of 3 to 8 vertices in both file formats, then loads
+// each through PolygonReader: once parse-only into a sink that drops every
+// batch (memory stays at about two chunks however large the file), and,
+// when it fits, into an RTree.
+void bench_file_ingest(int n, int treeLimit) {
+    const string csvPath = "bench_polygons.csv";
+    const string binPath = "bench_polygons.bin";
+    {
+        mt19937 rng(6);
+        ofstream csv(csvPath, ios::trunc);
+        ofstream bin(binPath, ios::binary | ios::trunc);
+        uint32_t magic = POLYGON_MAGIC;
+        bin.write((const char*)&magic, sizeof(magic));
+
+        vector<pair<int, int>> pol;
+        for (int i = 0; i < n; ++i) {
+            int x = rng() % 1000000;
+            int y = rng() % 1000000;
+            pol.clear();
+            for (int k = 3 + rng() % 6; k > 0; --k) {
+                pol.push_back({ x + (int)(rng() % 100), y + (int)(rng() % 100) });
+            }
+            for (unsigned int k = 0; k < pol.size(); ++k) {
+                csv << (k ? ", " : "") << pol[k].first << " " << pol[k].second;
+            }
+            csv << "\n";
+            uint32_t count = (uint32_t)pol.size();
+            bin.write((const char*)&count, sizeof(count));
+            bin.write((const char*)pol.data(), count * sizeof(pair<int, int>));
+        }
+    }
+
+    int threads = max(1u, thread::hardware_concurrency());
+    cout << "--- FILE INGEST (" << n << " polygons, " << threads << " parse threads) ---" << endl;
+    for (PolygonFormat format : { POLYGON_CSV, POLYGON_BINARY }) {
+        const string& path = format == POLYGON_CSV ? csvPath : binPath;
+        const char* name = format == POLYGON_CSV ? "csv   " : "binary";
+        PolygonReader reader(threads, 4 << 20);
+        LoadStats stats;
+
+        reader.Load(path, format, [](vector<Branch>&) {}, &stats);
+        cout << name << " parse only: " << stats.m_totalMs << " ms, "
+             << (long long)(stats.m_polygons / (stats.m_totalMs / 1000.0)) << " polygons/s, "
+             << stats.m_bytes / (1 << 20) << " MB" << endl;
+
+        if (n <= treeLimit) {
+            RTree tree;
+            reader.Load(path, format, tree, &stats);
+            cout << name << " into RTree: " << stats.m_totalMs << " ms (insert " << stats.m_sinkMs
+                 << " ms, waiting on parse " << stats.m_parseMs << " ms)" << endl;
+        }
+    }
+
+    unlink(csvPath.c_str());
+    unlink(binPath.c_str());
+}
+
+int main(int argc, char** argv)
+{
+    int n = argc > 1 ? stoi(argv[1]) : 100000;
+    int files = argc > 2 ? stoi(argv[2]) : n;
+
+    bench_point_memory(n);
+    bench_hilbert(n);
+    bench_sharded_ingest(n);
+    bench_buffered_ingest(n);
+    bench_path_cache(n);
+    bench_reorganize(min(n, 20000));
+    bench_paged_faults(n);
+    bench_file_ingest(files, 2000000);
+
+    return 0;
+}
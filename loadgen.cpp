@@ -0,0 +1,125 @@
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "QueryProtocol.h"
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+mutex g_latencyMutex;
+vector<double> g_latencies;
+
+QueryRequest random_request(uint32_t id, int type, mt19937& rng) {
+    QueryRequest req;
+    req.m_id = id;
+    req.m_type = type;
+    int x = rng() % 100000;
+    int y = rng() % 100000;
+    if (type == QUERY_KNN) {
+        req.m_args[0] = x;
+        req.m_args[1] = y;
+        req.m_args[2] = 10;
+        req.m_args[3] = 0;
+    } else {
+        req.m_args[0] = x;
+        req.m_args[1] = y;
+        req.m_args[2] = x + 1000;
+        req.m_args[3] = y + 1000;
+    }
+    return req;
+}
+
+// Keeps `depth` requests in flight on one connection until `total` are answered.
+void client_loop(const string& socketPath, int depth, int total, int type, unsigned int seed) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+    if (fd < 0 || connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        cerr << "ERROR: cannot connect to " << socketPath << endl;
+        return;
+    }
+
+    mt19937 rng(seed);
+    vector<Clock::time_point> sent(total);
+    vector<bool> answered(total, false);
+    vector<double> latencies;
+    vector<char> body;
+    int issued = 0;
+
+    auto issue = [&]() {
+        QueryRequest req = random_request(issued, type, rng);
+        sent[issued] = Clock::now();
+        WriteFull(fd, &req, sizeof(req));
+        ++issued;
+    };
+
+    while (issued < min(depth, total)) issue();
+
+    for (int done = 0; done < total; ++done) {
+        QueryResponseHeader header;
+        if (!ReadFull(fd, &header, sizeof(header))) break;
+        body.resize(header.m_length);
+        if (header.m_length > 0 && !ReadFull(fd, body.data(), header.m_length)) break;
+
+        if (header.m_id >= (uint32_t)issued || answered[header.m_id]) {
+            cerr << "ERROR: response for unknown request id " << header.m_id << endl;
+            break;
+        }
+        answered[header.m_id] = true;
+        latencies.push_back(chrono::duration<double, micro>(Clock::now() - sent[header.m_id]).count());
+        if (issued < total) issue();
+    }
+    close(fd);
+
+    lock_guard<mutex> lock(g_latencyMutex);
+    g_latencies.insert(g_latencies.end(), latencies.begin(), latencies.end());
+}
+
+double percentile(const vector<double>& sorted, double p) {
+    if (sorted.empty()) return 0;
+    return sorted[min(sorted.size() - 1, (size_t)(p * sorted.size()))];
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        cerr << "usage: " << argv[0] << " <socket-path> [connections] [depth] [requests-per-connection] [window|knn|count]" << endl;
+        return 1;
+    }
+    string socketPath = argv[1];
+    int connections = argc > 2 ? stoi(argv[2]) : 4;
+    int depth = argc > 3 ? stoi(argv[3]) : 16;
+    int perConnection = argc > 4 ? stoi(argv[4]) : 10000;
+    string kind = argc > 5 ? argv[5] : "window";
+    int type = kind == "knn" ? QUERY_KNN : kind == "count" ? QUERY_COUNT : QUERY_WINDOW;
+
+    auto start = Clock::now();
+    vector<thread> clients;
+    for (int i = 0; i < connections; ++i) {
+        clients.push_back(thread(client_loop, socketPath, depth, perConnection, type, i + 1));
+    }
+    for (auto& t : clients) t.join();
+    double seconds = chrono::duration<double>(Clock::now() - start).count();
+
+    sort(g_latencies.begin(), g_latencies.end());
+    cout << kind << ": " << g_latencies.size() << " requests in " << seconds << " s, "
+         << (long long)(g_latencies.size() / seconds) << " req/s" << endl;
+    cout << "latency us  p50 " << percentile(g_latencies, 0.50)
+         << "  p99 " << percentile(g_latencies, 0.99)
+         << "  p99.9 " << percentile(g_latencies, 0.999)
+         << "  max " << (g_latencies.empty() ? 0 : g_latencies.back()) << endl;
+
+    return 0;
+}
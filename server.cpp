@@ -0,0 +1,191 @@
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include "RTree.h"
+#include "QueryProtocol.h"
+
+using namespace std;
+
+#define MAX_BATCH 64
+
+struct Connection
+{
+    Connection(int fd) : m_fd(fd) {}
+    ~Connection() { close(m_fd); }
+
+    int m_fd;
+    mutex m_writeMutex;
+};
+
+struct PendingQuery
+{
+    shared_ptr<Connection> m_conn;
+    QueryRequest m_req;
+};
+
+RTree g_index;
+deque<PendingQuery> g_queue;
+mutex g_queueMutex;
+condition_variable g_queueReady;
+
+void load_polygons(const string& path, RTree& index) {
+    ifstream in(path);
+    string line;
+    while (getline(in, line)) {
+        for (auto& c : line) {
+            if (c == ',' || c == ';') c = ' ';
+        }
+        istringstream fields(line);
+        vector<pair<int, int>> pol;
+        int x, y;
+        while (fields >> x >> y) {
+            pol.push_back({ x, y });
+        }
+        if (!pol.empty()) {
+            Rect rect = index.MBR(pol);
+            index.Insert(rect.m_min, rect.m_max, pol);
+        }
+    }
+}
+
+void load_random(int n, RTree& index) {
+    mt19937 rng(1);
+    for (int i = 0; i < n; ++i) {
+        int x = rng() % 100000;
+        int y = rng() % 100000;
+        vector<pair<int, int>> pol = { {x, y}, {x + (int)(rng() % 50), y + (int)(rng() % 50)} };
+        Rect rect = index.MBR(pol);
+        index.Insert(rect.m_min, rect.m_max, pol);
+    }
+}
+
+void append_response(vector<char>& out, const QueryRequest& req) {
+    QueryResponseHeader header;
+    header.m_id = req.m_id;
+
+    vector<vector<pair<int, int>>> results;
+    if (req.m_type == QUERY_WINDOW) {
+        g_index.Search(Rect(req.m_args[0], req.m_args[1], req.m_args[2], req.m_args[3]), results);
+    } else if (req.m_type == QUERY_KNN) {
+        g_index.Nearest(req.m_args[0], req.m_args[1], req.m_args[2], results);
+    }
+    header.m_count = (uint32_t)results.size();
+    if (req.m_type == QUERY_COUNT) {
+        header.m_count = (uint32_t)g_index.Count(Rect(req.m_args[0], req.m_args[1], req.m_args[2], req.m_args[3]));
+    }
+
+    size_t start = out.size();
+    AppendRaw(out, &header, sizeof(header));
+
+    if (req.m_type != QUERY_COUNT) {
+        for (const auto& pol : results) {
+            uint32_t n = (uint32_t)pol.size();
+            AppendRaw(out, &n, sizeof(n));
+            for (const auto& p : pol) {
+                int32_t xy[2] = { p.first, p.second };
+                AppendRaw(out, xy, sizeof(xy));
+            }
+        }
+    }
+
+    uint32_t length = (uint32_t)(out.size() - start - sizeof(header));
+    memcpy(&out[start], &length, sizeof(length));
+}
+
+// Each worker takes whatever is queued (up to MAX_BATCH), runs it, and sends
+// the answers for one connection with a single write.
+void worker_loop() {
+    vector<PendingQuery> batch;
+    map<Connection*, pair<shared_ptr<Connection>, vector<char>>> replies;
+
+    while (true) {
+        {
+            unique_lock<mutex> lock(g_queueMutex);
+            g_queueReady.wait(lock, [] { return !g_queue.empty(); });
+            while (!g_queue.empty() && batch.size() < MAX_BATCH) {
+                batch.push_back(g_queue.front());
+                g_queue.pop_front();
+            }
+        }
+
+        for (auto& query : batch) {
+            auto& reply = replies[query.m_conn.get()];
+            reply.first = query.m_conn;
+            append_response(reply.second, query.m_req);
+        }
+
+        for (auto& entry : replies) {
+            Connection* conn = entry.first;
+            lock_guard<mutex> lock(conn->m_writeMutex);
+            WriteFull(conn->m_fd, entry.second.second.data(), entry.second.second.size());
+        }
+
+        batch.clear();
+        replies.clear();
+    }
+}
+
+void reader_loop(shared_ptr<Connection> conn) {
+    QueryRequest req;
+    while (ReadFull(conn->m_fd, &req, sizeof(req))) {
+        lock_guard<mutex> lock(g_queueMutex);
+        g_queue.push_back({ conn, req });
+        g_queueReady.notify_one();
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        cerr << "usage: " << argv[0] << " <socket-path> [polygons-file]" << endl;
+        return 1;
+    }
+    string socketPath = argv[1];
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if (argc > 2) {
+        load_polygons(argv[2], g_index);
+    } else {
+        load_random(100000, g_index);
+    }
+    cout << "index loaded: " << g_index.Count() << " objects" << endl;
+
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+    unlink(socketPath.c_str());
+
+    if (listenFd < 0 || bind(listenFd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listenFd, 64) < 0) {
+        cerr << "ERROR: cannot listen on " << socketPath << endl;
+        return 1;
+    }
+
+    int workers = max(1u, thread::hardware_concurrency());
+    for (int i = 0; i < workers; ++i) {
+        thread(worker_loop).detach();
+    }
+    cout << "listening on " << socketPath << " with " << workers << " workers" << endl;
+
+    while (true) {
+        int fd = accept(listenFd, NULL, NULL);
+        if (fd < 0) continue;
+        thread(reader_loop, make_shared<Connection>(fd)).detach();
+    }
+
+    return 0;
+}